@@ -6,12 +6,45 @@ set -x
 # For SaveFile:
 #   $2 - Suggested folder in which the file should be saved.
 #   $3 - Suggested name of the file.
+# For SaveFiles:
+#   $2 - Suggested folder in which the files should be saved.
+#   Names of the files are in request record on fd 5 (see below), one
+#   file=... pair per file. Write a single folder to fd 4, files will be
+#   saved there under their names.
 # For OpenFile:
 #   $2 - Suggested folder from which the files should be opened.
 #   $3 - 1 if multiple files can be selected, 0 otherwise.
 #   $4 - 1 if folders should be selected instead of files, 0 otherwise.
 #
 # Your script should write paths, each ending with newline, to fd 4.
+# If TERMFILECHOOSER_NULL_DELIMITED is 1 (null_delimited in config), paths
+# must end with NUL byte instead, e.g. printf '%s\0' "$path" >&4. This script
+# doesn't support it, lf separates $fx with newlines anyway.
+#
+# If TERMFILECHOOSER_RESULT_MEMFD is 1 (result_memfd in config), fd 6 is an
+# empty memfd and paths can be written there instead, in the same format. It
+# is read after fd 4 is closed, so write everything to fd 6 before that.
+# Paths written to both fd 4 and fd 6 are all used, fd 4 ones first.
+#
+# If pool_size is set in config, the script is started in advance without
+# any arguments. Arguments described above are then written to fd 3, one per
+# line, when a request arrives, and fd 3 is closed after the last one.
+# A pooled picker should bring up its UI before it starts reading fd 3,
+# otherwise the request still waits for it and the pool gains nothing. This
+# script starts foot right away and waits for arguments inside it, so only
+# lf itself is started once the request arrives.
+#
+# If request_record is set in config (and always for SaveFiles), fd 5 holds a read-only memfd with
+# key=value pairs, each one terminated by NUL byte: type, app_id,
+# parent_window, title, folder, name and current_file (SaveFile), multiple
+# and directory (OpenFile), modal and accept_label. Keys for options that the
+# app didn't provide are omitted.
+# If the app provided filters, filter is the name of the one to start with,
+# followed by a glob=... pair for each of its patterns, with MIME types
+# already turned into globs. For OpenFile, paths that match none of the app's
+# filters are dropped, so it's best to only show files that match the globs.
+# Values can contain newlines. Example of reading it:
+#   tr '\0' '\n' <&5
 
 die() {
     echo "$1" >&2
@@ -42,6 +75,27 @@ Notes:
 EOF
 )"
 
+if [ "$#" -eq 0 ] && [ -z "$LF_WRAPPER_IN_TERMINAL" ]; then
+    # started as a pool worker, run this script again inside the terminal,
+    # where it waits for a request. $0 may not be openable from there
+    LF_WRAPPER_IN_TERMINAL=1 exec foot sh -c "$(cat "$0")" lf-wrapper.sh
+fi
+
+if [ -n "$LF_WRAPPER_IN_TERMINAL" ]; then
+    # already running in foot
+    terminal=
+else
+    terminal=foot
+fi
+
+if [ "$#" -eq 0 ]; then
+    # pool worker inside the terminal, wait for a request
+    while IFS= read -r arg <&3; do
+        set -- "$@" "$arg"
+    done
+    [ "$#" -eq 0 ] && die "Portal went away before sending a request"
+fi
+
 type="$1"
 
 case "$type" in
@@ -59,17 +113,31 @@ case "$type" in
         # This is what will be displayed at the top of lf window, see lf docs for details
         promptfmt=' \033[1;31mSaving file:\033[0m \033[1;34m%w/\033[1;37m%f\033[0m'
 
-        # launch lf running in foot.
+        # launch lf running in foot (unless already in it).
         # map enter key to execute echo with selected files as arguments,
         # with its output redirected to pipe file descriptor provided by portal,
         # and then quit lf.
-        foot \
+        $terminal \
             lf \
             -command "set promptfmt \"${promptfmt}\"" \
             -command 'cmd confirm $echo "$fx" >&4' \
             -command 'map <enter> :confirm; quit' \
             "$suggested_file_path"
         ;;
+    (1) # SaveFiles
+        current_folder="$2"
+
+        promptfmt=' \033[1;31mSaving files to:\033[0m \033[1;34m%d\033[0m'
+
+        # pick a folder, file names come from the app
+        $terminal \
+            lf \
+            -command 'set dironly true' \
+            -command "set promptfmt \"${promptfmt}\"" \
+            -command 'cmd confirm $echo "$f" >&4' \
+            -command 'map <enter> :confirm; quit' \
+            "$current_folder"
+        ;;
     (2) # OpenFile
         current_folder="$2"
         multiple="$3"
@@ -90,7 +158,7 @@ case "$type" in
             dironly_cmd='set dironly false'
         fi
 
-        foot \
+        $terminal \
             lf \
             -command "$dironly_cmd" \
             -command "set promptfmt \"${promptfmt}\"" \
@@ -145,6 +145,24 @@ struct pollen_callback *pollen_loop_add_timer(struct pollen_loop *loop, unsigned
                                               pollen_timer_callback_fn callback,
                                               void *data);
 
+/*
+ * Changes events that fd callback is waiting for, see pollen_loop_add_fd.
+ *
+ * Returns -1 and sets errno on failure.
+ */
+int pollen_fd_modify_events(struct pollen_callback *callback, uint32_t events);
+
+/*
+ * Rearms timer callback to run in delay_ms milliseconds, and then periodically
+ * every interval_ms milliseconds. If interval_ms is 0, timer runs only once.
+ * If delay_ms is 0, timer is disarmed until it's rearmed again.
+ * Timer added with delay_ms 0 starts disarmed.
+ *
+ * Returns -1 and sets errno on failure.
+ */
+int pollen_timer_rearm(struct pollen_callback *callback, unsigned long delay_ms,
+                       unsigned long interval_ms);
+
 /*
  * Remove a callback from event loop.
  *
@@ -283,6 +301,10 @@ struct pollen_callback {
     void *data;
 
     struct pollen_ll link;
+
+    /* removed while loop was dispatching events, will be freed after current iteration */
+    bool removed;
+    struct pollen_callback *next_removed;
 };
 
 struct pollen_loop {
@@ -301,6 +323,13 @@ struct pollen_loop {
     struct pollen_ll idle_callbacks_list;
     struct pollen_ll signal_callbacks_list;
     struct pollen_ll timer_callbacks_list;
+
+    /*
+     * Callbacks removed while dispatching are not freed right away because
+     * epoll might have returned events for them in the same batch.
+     */
+    bool dispatching;
+    struct pollen_callback *removed_callbacks;
 };
 
 /* not an actual real callback, more like a hack to hook signal handling into the loop */
@@ -679,6 +708,43 @@ err:
     return NULL;
 }
 
+int pollen_fd_modify_events(struct pollen_callback *callback, uint32_t events) {
+    int fd = callback->as.fd.fd;
+
+    POLLEN_LOG_DEBUG("modifying events for fd %d to %X", fd, events);
+
+    struct epoll_event epoll_event;
+    epoll_event.events = events;
+    epoll_event.data.ptr = callback;
+    if (epoll_ctl(callback->loop->epoll_fd, EPOLL_CTL_MOD, fd, &epoll_event) < 0) {
+        POLLEN_LOG_ERR("failed to modify fd %d in epoll: %s", fd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int pollen_timer_rearm(struct pollen_callback *callback, unsigned long delay_ms,
+                       unsigned long interval_ms) {
+    int tfd = callback->as.timer.fd;
+
+    POLLEN_LOG_DEBUG("rearming timer on tfd %d, delay %lu ms, interval %lu ms",
+                     tfd, delay_ms, interval_ms);
+
+    struct itimerspec itimerspec;
+    itimerspec.it_interval.tv_sec = interval_ms / 1000;
+    itimerspec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    itimerspec.it_value.tv_sec = delay_ms / 1000;
+    itimerspec.it_value.tv_nsec = (delay_ms % 1000) * 1000000L;
+
+    if (timerfd_settime(tfd, 0, &itimerspec, NULL) < 0) {
+        POLLEN_LOG_ERR("failed to rearm timer on tfd %d: %s", tfd, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 void pollen_loop_remove_callback(struct pollen_callback *callback) {
     switch (callback->type) {
     case POLLEN_CALLBACK_TYPE_FD: {
@@ -747,7 +813,25 @@ void pollen_loop_remove_callback(struct pollen_callback *callback) {
 
     pollen_ll_remove(&callback->link);
 
-    POLLEN_FREE(callback);
+    if (callback->loop->dispatching) {
+        callback->removed = true;
+        callback->next_removed = callback->loop->removed_callbacks;
+        callback->loop->removed_callbacks = callback;
+    } else {
+        POLLEN_FREE(callback);
+    }
+}
+
+static void pollen_internal_free_removed_callbacks(struct pollen_loop *loop) {
+    loop->dispatching = false;
+
+    struct pollen_callback *callback = loop->removed_callbacks;
+    while (callback != NULL) {
+        struct pollen_callback *next = callback->next_removed;
+        POLLEN_FREE(callback);
+        callback = next;
+    }
+    loop->removed_callbacks = NULL;
 }
 
 struct pollen_loop *pollen_callback_get_loop(struct pollen_callback *callback) {
@@ -776,8 +860,12 @@ int pollen_loop_run(struct pollen_loop *loop) {
 
         POLLEN_LOG_DEBUG("received events on %d fds", number_fds);
 
+        loop->dispatching = true;
         for (int n = 0; n < number_fds; n++) {
             struct pollen_callback *callback = events[n].data.ptr;
+            if (callback->removed) {
+                continue;
+            }
 
             switch (callback->type) {
             case POLLEN_CALLBACK_TYPE_FD:
@@ -823,6 +911,10 @@ int pollen_loop_run(struct pollen_loop *loop) {
         /* process unconditional callbacks */
         struct pollen_callback *callback, *callback_tmp;
         POLLEN_LL_FOR_EACH_SAFE(callback, callback_tmp, &loop->idle_callbacks_list, link) {
+            if (callback->removed) {
+                continue;
+            }
+
             POLLEN_LOG_DEBUG("running unconditional callback with prio %d",
                              callback->as.idle.priority);
 
@@ -833,9 +925,12 @@ int pollen_loop_run(struct pollen_loop *loop) {
                 goto out;
             }
         }
+
+        pollen_internal_free_removed_callbacks(loop);
     }
 
 out:
+    pollen_internal_free_removed_callbacks(loop);
     return loop->retcode;
 }
 
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "xmalloc.h"
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    /* start of last allocation, for arena_realloc */
+    size_t last;
+    _Alignas(max_align_t) unsigned char data[];
+};
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static struct arena_block *block_new(size_t size) {
+    struct arena_block *block = xmalloc(sizeof(*block) + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    block->last = 0;
+    return block;
+}
+
+static void *block_alloc(struct arena_block *block, size_t size) {
+    block->last = block->used;
+    block->used += align_up(size);
+    return block->data + block->last;
+}
+
+struct arena *arena_create(size_t initial_size) {
+    size_t header_size = align_up(sizeof(struct arena));
+    if (initial_size < header_size * 2) {
+        initial_size = header_size * 2;
+    }
+
+    struct arena_block *block = block_new(initial_size);
+    struct arena *arena = block_alloc(block, sizeof(struct arena));
+    arena->blocks = block;
+    arena->next_block_size = initial_size * 2;
+    return arena;
+}
+
+void arena_destroy(struct arena *arena) {
+    struct arena_block *block = arena->blocks;
+    /* arena is in the last block, don't touch it after that one is freed */
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_block *block = arena->blocks;
+    if (block->size - block->used >= size) {
+        return block_alloc(block, size);
+    }
+
+    size_t block_size = arena->next_block_size;
+    if (block_size < size) {
+        block_size = align_up(size);
+    } else {
+        arena->next_block_size *= 2;
+    }
+
+    block = block_new(block_size);
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block_alloc(block, size);
+}
+
+void *arena_zalloc(struct arena *arena, size_t size) {
+    void *ptr = arena_alloc(arena, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr == NULL) {
+        return arena_alloc(arena, new_size);
+    }
+
+    struct arena_block *block = arena->blocks;
+    if ((unsigned char *)ptr == block->data + block->last &&
+            block->size - block->last >= new_size) {
+        block->used = block->last + align_up(new_size);
+        return ptr;
+    }
+
+    void *new_ptr = arena_alloc(arena, new_size);
+    memcpy(new_ptr, ptr, (old_size < new_size) ? old_size : new_size);
+    return new_ptr;
+}
+
+char *arena_strndup(struct arena *arena, const char *s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_strdup(struct arena *arena, const char *s) {
+    if (s == NULL) {
+        return NULL;
+    }
+    return arena_strndup(arena, s, strlen(s));
+}
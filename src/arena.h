@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for memory that lives exactly as long as something else,
+ * like a request. Nothing is freed individually, everything goes away at
+ * once in arena_destroy(). Blocks grow geometrically, so the number of
+ * malloc calls is logarithmic in the total size.
+ */
+
+struct arena_block;
+
+struct arena {
+    /* current block first */
+    struct arena_block *blocks;
+    size_t next_block_size;
+};
+
+/* arena itself lives in its first block of initial_size bytes */
+struct arena *arena_create(size_t initial_size);
+void arena_destroy(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_zalloc(struct arena *arena, size_t size);
+/* grows ptr in place if it was the last allocation, otherwise copies it */
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+/* returns NULL if s is NULL */
+char *arena_strdup(struct arena *arena, const char *s);
+char *arena_strndup(struct arena *arena, const char *s, size_t len);
+
+#endif /* #ifndef ARENA_H */
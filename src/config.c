@@ -1,6 +1,9 @@
+#define _GNU_SOURCE /* O_PATH, F_DUPFD_CLOEXEC */
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -10,6 +13,20 @@
 #include "log.h"
 #include "xmalloc.h"
 
+/* parses non-negative decimal integer, returns -1 if str is not one */
+static int parse_uint(const char *str, int *res) {
+    char *endptr;
+
+    errno = 0;
+    long val = strtol(str, &endptr, 10);
+    if (errno != 0 || *endptr != '\0' || endptr == str || val < 0 || val > INT_MAX) {
+        return -1;
+    }
+
+    *res = val;
+    return 0;
+}
+
 static int config_parse_file(struct xdptf_config *config, const char *path) {
     int ret = 0;
     int line_number = 0;
@@ -72,6 +89,8 @@ static int config_parse_file(struct xdptf_config *config, const char *path) {
 
         if (strcmp(k, "picker_cmd") == 0) {
             config->picker_cmd = xstrdup(v);
+        } else if (strcmp(k, "picker_socket") == 0) {
+            config->picker_socket = xstrdup(v);
         } else if (strcmp(k, "default_dir") == 0) {
             config->default_dir = xstrdup(v);
         } else if (strcmp(k, "loglevel") == 0) {
@@ -90,6 +109,79 @@ static int config_parse_file(struct xdptf_config *config, const char *path) {
                 ret = -1;
                 goto out;
             }
+        } else if (strcmp(k, "pool_size") == 0) {
+            if (parse_uint(v, &config->pool_size) < 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid pool size", line_number, v);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "request_record") == 0) {
+            if (parse_uint(v, &config->request_record) < 0 || config->request_record > 1) {
+                log_print(ERROR, "config: line %d: request_record must be 0 or 1", line_number);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "null_delimited") == 0) {
+            if (parse_uint(v, &config->null_delimited) < 0 || config->null_delimited > 1) {
+                log_print(ERROR, "config: line %d: null_delimited must be 0 or 1", line_number);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "result_memfd") == 0) {
+            if (parse_uint(v, &config->result_memfd) < 0 || config->result_memfd > 1) {
+                log_print(ERROR, "config: line %d: result_memfd must be 0 or 1", line_number);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "max_pickers") == 0) {
+            if (parse_uint(v, &config->max_pickers) < 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid picker limit", line_number, v);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "max_pickers_per_app") == 0) {
+            if (parse_uint(v, &config->max_pickers_per_app) < 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid picker limit", line_number, v);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "request_timeout") == 0) {
+            if (parse_uint(v, &config->request_timeout) < 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid timeout", line_number, v);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "max_queued_requests") == 0) {
+            if (parse_uint(v, &config->max_queued_requests) < 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid queue depth", line_number, v);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "dbus_process_budget") == 0) {
+            if (parse_uint(v, &config->dbus_process_budget) < 0 ||
+                    config->dbus_process_budget == 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid budget", line_number, v);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "max_result_size") == 0) {
+            if (parse_uint(v, &config->max_result_size) < 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid size", line_number, v);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "max_result_paths") == 0) {
+            if (parse_uint(v, &config->max_result_paths) < 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid path limit", line_number, v);
+                ret = -1;
+                goto out;
+            }
+        } else if (strcmp(k, "max_buffered_size") == 0) {
+            if (parse_uint(v, &config->max_buffered_size) < 0) {
+                log_print(ERROR, "config: line %d: %s is not a valid size", line_number, v);
+                ret = -1;
+                goto out;
+            }
         } else {
             log_print(WARN, "config: line %d: %s is not a valid key", line_number, k);
         }
@@ -155,13 +247,107 @@ static void config_fill_missing_values(struct xdptf_config *config) {
     }
 }
 
+/* looks up cmd in PATH like execvp() does, result is put in path */
+static int config_search_path(const char *cmd, char path[static PATH_MAX]) {
+    const char *search_path = getenv("PATH");
+    if (search_path == NULL) {
+        search_path = "/usr/local/bin:/bin:/usr/bin";
+    }
+
+    const char *dir = search_path;
+    while (true) {
+        const char *dir_end = strchrnul(dir, ':');
+        int dir_len = dir_end - dir;
+        /* empty entry means current directory */
+        if (snprintf(path, PATH_MAX, "%.*s%s%s", dir_len, dir,
+                     (dir_len > 0) ? "/" : "", cmd) < PATH_MAX &&
+                access(path, X_OK) == 0) {
+            return 0;
+        }
+        if (*dir_end == '\0') {
+            break;
+        }
+        dir = dir_end + 1;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+/* whether file starts with #!, unreadable file can't be a script either */
+static bool is_script(const char *path) {
+    char magic[2];
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ret = (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                magic[0] == '#' && magic[1] == '!');
+    close(fd);
+
+    return ret;
+}
+
+static int config_open_picker(struct xdptf_config *config) {
+    char path[PATH_MAX];
+    const char *resolved = config->picker_cmd;
+
+    if (strchr(config->picker_cmd, '/') == NULL) {
+        if (config_search_path(config->picker_cmd, path) < 0) {
+            log_print(ERROR, "config: %s not found in PATH", config->picker_cmd);
+            return -1;
+        }
+        resolved = path;
+    }
+    if (access(resolved, X_OK) < 0) {
+        log_print(ERROR, "config: %s is not executable: %s", resolved, strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Pickers are spawned with posix_spawn(), so they are executed by
+     * /proc/self/fd/ path and not with execveat(). Binary is opened by the
+     * kernel before close-on-exec happens, but interpreter of a script opens
+     * the path itself, so for scripts the fd must survive exec (it would have
+     * to with execveat() too). It's never passed to anything else.
+     */
+    bool script = is_script(resolved);
+    int fd = open(resolved, O_PATH | (script ? 0 : O_CLOEXEC));
+    if (fd < 0) {
+        log_print(ERROR, "config: failed to open %s: %s", resolved, strerror(errno));
+        return -1;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        log_print(ERROR, "config: %s is not a regular file", resolved);
+        close(fd);
+        return -1;
+    }
+    /* fds 3, 4, 5 and 6 are overwritten in picker before exec */
+    if (fd <= 6) {
+        int new_fd = fcntl(fd, script ? F_DUPFD : F_DUPFD_CLOEXEC, 7);
+        close(fd);
+        if (new_fd < 0) {
+            log_print(ERROR, "config: failed to duplicate fd: %s", strerror(errno));
+            return -1;
+        }
+        fd = new_fd;
+    }
+
+    config->picker_fd = fd;
+    snprintf(config->picker_exe, sizeof(config->picker_exe), "/proc/self/fd/%d", fd);
+    log_print(INFO, "config: resolved picker %s to %s", config->picker_cmd, resolved);
+
+    return 0;
+}
+
 static int config_verify(struct xdptf_config *config) {
     if (config->picker_cmd == NULL) {
         log_print(ERROR, "config: picker cmd is not specified");
         return -1;
     }
-    if (access(config->picker_cmd, X_OK) < 0) {
-        log_print(ERROR, "config: %s is not executable: %s", config->picker_cmd, strerror(errno));
+    if (config_open_picker(config) < 0) {
         return -1;
     }
 
@@ -175,6 +361,13 @@ static int config_verify(struct xdptf_config *config) {
 }
 
 int config_init(struct xdptf_config *config, const char *path) {
+    config->picker_fd = -1;
+    config->max_queued_requests = 32;
+    config->dbus_process_budget = 64;
+    /* 64 MiB per request, 256 MiB in total */
+    config->max_result_size = 64 * 1024;
+    config->max_buffered_size = 256 * 1024;
+
     if (config_parse(config, path) < 0) {
         return -1;
     }
@@ -185,5 +378,9 @@ int config_init(struct xdptf_config *config, const char *path) {
 void config_cleanup(struct xdptf_config *config) {
     free(config->default_dir);
     free(config->picker_cmd);
+    free(config->picker_socket);
+    if (config->picker_fd >= 0) {
+        close(config->picker_fd);
+    }
 }
 
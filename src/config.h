@@ -5,8 +5,42 @@
 
 struct xdptf_config {
     char *picker_cmd;
+    /*
+     * picker_cmd is resolved and opened once at startup, pickers are executed
+     * through picker_exe (/proc/self/fd/<picker_fd>) so replacing or moving
+     * the file doesn't affect running daemon. picker_fd is close-on-exec,
+     * unless picker is a script and its interpreter needs it.
+     */
+    int picker_fd;
+    char picker_exe[32];
+    /* path to picker server socket, NULL if not used */
+    char *picker_socket;
     char *default_dir;
     enum log_loglevel loglevel;
+    /* number of pickers to start in advance, 0 disables the pool */
+    int pool_size;
+    /* pass request record (see record.h) to pickers on fd 5 */
+    int request_record;
+    /* pickers terminate paths with NUL instead of newline */
+    int null_delimited;
+    /* pass empty memfd to pickers on fd 6, they can write result there instead of fd 4 */
+    int result_memfd;
+    /* limits on running pickers, 0 means no limit */
+    int max_pickers;
+    int max_pickers_per_app;
+    /* requests over the limits wait in a queue, the ones past this depth are rejected */
+    int max_queued_requests;
+    /* seconds before unfinished request is ended and its picker killed, 0 means never */
+    int request_timeout;
+    /* max number of dbus messages processed per event loop iteration */
+    int dbus_process_budget;
+    /*
+     * limits on picker output, in KiB and paths for a single request, and in KiB
+     * for all requests together. requests over them are ended. 0 means no limit.
+     */
+    int max_result_size;
+    int max_result_paths;
+    int max_buffered_size;
 };
 
 /* if path is not NULL it will ignore default locations and try to parse file at path */
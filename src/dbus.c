@@ -1,4 +1,11 @@
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
 #include "pollen.h"
+#include "dbus.h"
 #include "xdptf.h"
 #include "filechooser.h"
 #include "log.h"
@@ -7,9 +14,30 @@ static const sd_bus_vtable filechooser_vtable[] = {
     SD_BUS_VTABLE_START(0),
     SD_BUS_METHOD("OpenFile", "osssa{sv}", "ua{sv}", method_open_file, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("SaveFile", "osssa{sv}", "ua{sv}", method_save_file, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("SaveFiles", "osssa{sv}", "ua{sv}", method_save_files, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END
+};
+
+static const sd_bus_vtable request_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Close", "", "", method_request_close, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_VTABLE_END
 };
 
+/* finds request for Close by its handle */
+static int find_request(sd_bus *bus, const char *path, const char *interface,
+                        void *data, void **ret_found, sd_bus_error *ret_error) {
+    struct xdptf *xdptf = data;
+
+    struct filechooser_request *request = hashmap_get(&xdptf->requests_by_handle, path);
+    if (request == NULL) {
+        return 0;
+    }
+
+    *ret_found = request;
+    return 1;
+}
+
 static int handle_name_lost(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
     struct xdptf *xdptf = data;
 
@@ -46,6 +74,19 @@ int dbus_init(struct xdptf *xdptf, bool replace) {
         return ret;
     }
 
+    /*
+     * one vtable for all requests instead of one per request, so starting and
+     * finishing a request doesn't touch sd-bus object tree
+     */
+    static const char request_interface_name[] = "org.freedesktop.impl.portal.Request";
+    ret = sd_bus_add_fallback_vtable(xdptf->sd_bus, &xdptf->request_vtable_slot,
+                                     DBUS_REQUEST_PATH_PREFIX, request_interface_name,
+                                     request_vtable, find_request, xdptf);
+    if (ret < 0) {
+        log_print(ERROR, "failed to add request vtable: %s", strerror(-ret));
+        return ret;
+    }
+
     uint64_t flags = SD_BUS_NAME_ALLOW_REPLACEMENT;
     if (replace) {
         flags |= SD_BUS_NAME_REPLACE_EXISTING;
@@ -82,6 +123,197 @@ int dbus_init(struct xdptf *xdptf, bool replace) {
     return 0;
 }
 
+/*
+ * sd-bus tells what it's waiting for with sd_bus_get_events() and sd_bus_get_timeout(),
+ * both can change after anything it does. dbus fd waits for EPOLLOUT only while
+ * there are messages stuck in write queue, so big replies to slow clients are
+ * written as soon as the socket has room, and timer fires when method call
+ * timeouts or authentication deadline expire.
+ */
+static int dbus_update_events(struct xdptf *xdptf) {
+    int ret = sd_bus_get_events(xdptf->sd_bus);
+    if (ret < 0) {
+        log_print(ERROR, "dbus: failed to get events: %s", strerror(-ret));
+        return ret;
+    }
+    uint32_t events = 0;
+    if (ret & POLLIN) {
+        events |= EPOLLIN;
+    }
+    if (ret & POLLOUT) {
+        events |= EPOLLOUT;
+    }
+    if (events != xdptf->sd_bus_events) {
+        if (pollen_fd_modify_events(xdptf->sd_bus_callback, events) < 0) {
+            ret = -errno;
+            log_print(ERROR, "dbus: failed to update events: %s", strerror(errno));
+            return ret;
+        }
+        xdptf->sd_bus_events = events;
+    }
+
+    uint64_t timeout_us;
+    if ((ret = sd_bus_get_timeout(xdptf->sd_bus, &timeout_us)) < 0) {
+        log_print(ERROR, "dbus: failed to get timeout: %s", strerror(-ret));
+        return ret;
+    }
+    unsigned long delay_ms = 0;
+    if (timeout_us != UINT64_MAX) {
+        /* timeout is absolute CLOCK_MONOTONIC time */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t now_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+        if (timeout_us > now_us) {
+            /* round up, timer must not fire before sd-bus has something to do */
+            delay_ms = (timeout_us - now_us + 999) / 1000;
+        } else if (eventfd_write(xdptf->sd_bus_wakeup_fd, 1) < 0) {
+            /* already expired, or sd-bus has messages it read but didn't process yet */
+            log_print(WARN, "dbus: failed to signal wakeup fd: %s", strerror(errno));
+        }
+    }
+    /* nothing to do if timer stays disarmed, otherwise delay is relative to now */
+    if (delay_ms != 0 || xdptf->sd_bus_timeout_ms != 0) {
+        if (pollen_timer_rearm(xdptf->sd_bus_timer_callback, delay_ms, 0) < 0) {
+            ret = -errno;
+            log_print(ERROR, "dbus: failed to arm timer: %s", strerror(errno));
+            return ret;
+        }
+        xdptf->sd_bus_timeout_ms = delay_ms;
+    }
+
+    return 0;
+}
+
+/*
+ * sd_bus_process() handles a single message per call, so keep calling it until
+ * there is nothing left, but at most dbus_process_budget times, so a flood of
+ * method calls doesn't keep picker pipes waiting. if budget runs out, wakeup fd
+ * is signalled and the rest is processed on next event loop iteration.
+ */
+static int dbus_process(struct xdptf *xdptf) {
+    int budget = xdptf->config.dbus_process_budget;
+    int n_messages = 0;
+    int ret = 0;
+    while (n_messages < budget) {
+        if ((ret = sd_bus_process(xdptf->sd_bus, NULL)) < 0) {
+            log_print(ERROR, "dbus: failed to process events: %s", strerror(-ret));
+            return ret;
+        } else if (ret == 0) {
+            break;
+        }
+        n_messages += 1;
+    }
+
+    bool exhausted = (ret > 0);
+    stats_add_bus_wakeup(&xdptf->stats, n_messages, exhausted);
+    if (exhausted) {
+        log_print(DEBUG, "dbus: processed %d messages, continuing on next iteration", n_messages);
+        if (eventfd_write(xdptf->sd_bus_wakeup_fd, 1) < 0) {
+            log_print(WARN, "dbus: failed to signal wakeup fd: %s", strerror(errno));
+        }
+    }
+
+    return dbus_update_events(xdptf);
+}
+
+static int dbus_event_handler(struct pollen_callback *callback,
+                              int fd, uint32_t events, void *data) {
+    struct xdptf *xdptf = data;
+
+    log_print(DEBUG, "processing dbus events");
+    return dbus_process(xdptf);
+}
+
+static int dbus_timer_handler(struct pollen_callback *callback, void *data) {
+    struct xdptf *xdptf = data;
+
+    log_print(DEBUG, "dbus: timeout expired");
+    return dbus_process(xdptf);
+}
+
+static int dbus_wakeup_handler(struct pollen_callback *callback,
+                               int fd, uint32_t events, void *data) {
+    struct xdptf *xdptf = data;
+
+    eventfd_t value;
+    eventfd_read(fd, &value);
+
+    return dbus_process(xdptf);
+}
+
+static int dbus_flush_callback(struct pollen_callback *callback, void *data) {
+    struct xdptf *xdptf = data;
+
+    pollen_loop_remove_callback(xdptf->sd_bus_flush_callback);
+    xdptf->sd_bus_flush_callback = NULL;
+
+    /*
+     * sd_bus_send() writes right away if it can, replies are only left
+     * in write queue when the socket is full. the rest is written once
+     * dbus fd becomes writable.
+     */
+    int events = sd_bus_get_events(xdptf->sd_bus);
+    if (events > 0 && (events & POLLOUT)) {
+        stats_add_bus_flush(&xdptf->stats);
+    }
+    return dbus_update_events(xdptf);
+}
+
+void dbus_schedule_flush(struct xdptf *xdptf) {
+    if (xdptf->sd_bus_flush_callback != NULL || xdptf->event_loop == NULL) {
+        return;
+    }
+
+    /* lowest priority, runs after everything that can send a reply */
+    xdptf->sd_bus_flush_callback = pollen_loop_add_idle(xdptf->event_loop, -1,
+                                                        dbus_flush_callback, xdptf);
+    if (xdptf->sd_bus_flush_callback == NULL) {
+        log_print(WARN, "dbus: failed to schedule flush: %s", strerror(errno));
+    }
+}
+
+int dbus_attach_event_loop(struct xdptf *xdptf) {
+    int ret = 0;
+
+    xdptf->sd_bus_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (xdptf->sd_bus_wakeup_fd < 0) {
+        ret = -errno;
+        log_print(ERROR, "dbus: failed to create wakeup fd: %s", strerror(errno));
+        return ret;
+    }
+    if (pollen_loop_add_fd(xdptf->event_loop, xdptf->sd_bus_wakeup_fd, EPOLLIN, true,
+                           dbus_wakeup_handler, xdptf) == NULL) {
+        ret = -errno;
+        log_print(ERROR, "dbus: failed to watch wakeup fd: %s", strerror(errno));
+        close(xdptf->sd_bus_wakeup_fd);
+        xdptf->sd_bus_wakeup_fd = -1;
+        return ret;
+    }
+
+    xdptf->sd_bus_events = EPOLLIN;
+    xdptf->sd_bus_callback = pollen_loop_add_fd(xdptf->event_loop, xdptf->sd_bus_fd,
+                                                xdptf->sd_bus_events, false,
+                                                dbus_event_handler, xdptf);
+    if (xdptf->sd_bus_callback == NULL) {
+        ret = -errno;
+        log_print(ERROR, "dbus: failed to watch dbus fd: %s", strerror(errno));
+        return ret;
+    }
+
+    /* starts disarmed */
+    xdptf->sd_bus_timeout_ms = 0;
+    xdptf->sd_bus_timer_callback = pollen_loop_add_timer(xdptf->event_loop, 0,
+                                                         dbus_timer_handler, xdptf);
+    if (xdptf->sd_bus_timer_callback == NULL) {
+        ret = -errno;
+        log_print(ERROR, "dbus: failed to create timer: %s", strerror(errno));
+        return ret;
+    }
+
+    /* there might be something in write queue already, name request for example */
+    return dbus_update_events(xdptf);
+}
+
 void dbus_cleanup(struct xdptf *xdptf) {
     if (xdptf->name_owner_changed_slot != NULL) {
         sd_bus_slot_unref(xdptf->name_owner_changed_slot);
@@ -93,6 +325,11 @@ void dbus_cleanup(struct xdptf *xdptf) {
         xdptf->filechooser_vtable_slot = NULL;
     }
 
+    if (xdptf->request_vtable_slot != NULL) {
+        sd_bus_slot_unref(xdptf->request_vtable_slot);
+        xdptf->request_vtable_slot = NULL;
+    }
+
     if (xdptf->sd_bus != NULL) {
         sd_bus_flush(xdptf->sd_bus);
         sd_bus_close(xdptf->sd_bus);
@@ -3,8 +3,19 @@
 
 #include "xdptf.h"
 
+/* request handles are object paths under this one */
+#define DBUS_REQUEST_PATH_PREFIX "/org/freedesktop/portal/desktop/request"
+
 int dbus_init(struct xdptf *xdptf, bool replace);
 void dbus_cleanup(struct xdptf *xdptf);
 
+/* starts processing dbus messages in event loop, which must be created by now */
+int dbus_attach_event_loop(struct xdptf *xdptf);
+/*
+ * makes sure replies sent with sd_bus_send() leave the daemon once current
+ * event loop iteration is over, however many of them were sent during it.
+ */
+void dbus_schedule_flush(struct xdptf *xdptf);
+
 #endif /* #ifndef DBUS_H */
 
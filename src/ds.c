@@ -11,19 +11,24 @@ void ds_init(struct ds *ds) {
     ds->data = NULL;
 }
 
-/* append raw bytes to the dynamic string */
-void ds_append_bytes(struct ds *ds, const void *data, size_t data_len) {
-    size_t data_len_with_null = data_len + 1;
+/* makes sure there is space for n more bytes and null terminator */
+static void ds_grow(struct ds *ds, size_t n) {
+    size_t n_with_null = n + 1;
     /* check if realloc is needed */
-    if (ds->length + data_len_with_null > ds->capacity) {
+    if (ds->length + n_with_null > ds->capacity) {
         /* try doubling the capacity first */
-        ds->capacity = (ds->capacity == 0) ? data_len_with_null : (ds->capacity * 2);
+        ds->capacity = (ds->capacity == 0) ? n_with_null : (ds->capacity * 2);
         /* still not big enough? */
-        if (ds->length + data_len_with_null > ds->capacity) {
-            ds->capacity = ds->length + data_len_with_null;
+        if (ds->length + n_with_null > ds->capacity) {
+            ds->capacity = ds->length + n_with_null;
         }
         ds->data = xrealloc(ds->data, ds->capacity);
     }
+}
+
+/* append raw bytes to the dynamic string */
+void ds_append_bytes(struct ds *ds, const void *data, size_t data_len) {
+    ds_grow(ds, data_len);
 
     memcpy(ds->data + ds->length, data, data_len);
     ds->length += data_len;
@@ -32,6 +37,40 @@ void ds_append_bytes(struct ds *ds, const void *data, size_t data_len) {
     ds->data[ds->length] = '\0';
 }
 
+/* make sure at least n bytes can be written at the end of the dynamic string */
+char *ds_reserve(struct ds *ds, size_t n) {
+    ds_grow(ds, n);
+    return ds->data + ds->length;
+}
+
+/* mark n bytes written into reserved space as part of the dynamic string */
+void ds_commit(struct ds *ds, size_t n) {
+    ds->length += n;
+    ds->data[ds->length] = '\0';
+}
+
+/* remove first n bytes from the dynamic string */
+void ds_consume(struct ds *ds, size_t n) {
+    if (n >= ds->length) {
+        ds->length = 0;
+    } else {
+        memmove(ds->data, ds->data + n, ds->length - n);
+        ds->length -= n;
+    }
+
+    if (ds->data != NULL) {
+        ds->data[ds->length] = '\0';
+    }
+}
+
+/* shorten the dynamic string to length bytes */
+void ds_truncate(struct ds *ds, size_t length) {
+    if (length < ds->length) {
+        ds->length = length;
+        ds->data[length] = '\0';
+    }
+}
+
 /* free the dynamic string */
 void ds_free(struct ds *ds) {
     free(ds->data);
@@ -15,6 +15,15 @@ struct ds {
 
 void ds_init(struct ds *ds);
 void ds_append_bytes(struct ds *ds, const void *data, size_t data_len);
+/*
+ * returns pointer to spare capacity at the end of the string, at least n
+ * bytes long, so it can be filled directly (e.g. by read()). ds_commit()
+ * appends bytes that were actually written.
+ */
+char *ds_reserve(struct ds *ds, size_t n);
+void ds_commit(struct ds *ds, size_t n);
+void ds_consume(struct ds *ds, size_t n);
+void ds_truncate(struct ds *ds, size_t length);
 void ds_free(struct ds *ds);
 
 #endif /* #ifndef DS_H */
@@ -1,6 +1,11 @@
+#define _GNU_SOURCE /* F_SETPIPE_SZ, F_ADD_SEALS */
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -8,9 +13,13 @@
 
 #include "filechooser.h"
 #include "xdptf.h"
+#include "dbus.h"
 #include "log.h"
 #include "xmalloc.h"
+#include "pool.h"
 #include "picker.h"
+#include "remote.h"
+#include "record.h"
 #include "uri.h"
 
 enum {
@@ -19,16 +28,40 @@ enum {
     PORTAL_RESPONSE_ENDED = 2
 };
 
-static const char interface_name[] = "org.freedesktop.impl.portal.Request";
+/* how long picker has to exit after SIGTERM before it gets SIGKILL */
+#define PICKER_KILL_GRACE_PERIOD_MS 5000
+
+/* enough for request itself, its arguments and a few uris */
+#define REQUEST_ARENA_SIZE 4096
+
+/* picker output is read in chunks of this size, doubling while reads fill them */
+#define REQUEST_READ_MIN 4096
+#define REQUEST_READ_MAX (1024 * 1024)
+/* pipe size for requests that can return many paths */
+#define REQUEST_PIPE_SIZE (1024 * 1024)
+
+/* stops whatever is handling the request, request still has to be cleaned up */
+static void request_stop_picker(struct filechooser_request *request) {
+    if (request->queued) {
+        /* nothing to stop yet */
+    } else if (request->remote) {
+        remote_cancel_request(&request->xdptf->remote, request);
+    } else if (request->picker_pidfd >= 0 && !request->picker_reaped) {
+        /* picker is terminated and reaped without us, pidfd belongs to event loop now */
+        pollen_loop_remove_callback(request->pidfd_callback);
+        request->pidfd_callback = NULL;
+        terminate_picker(request->xdptf->event_loop, request->picker_pid,
+                         request->picker_pidfd, PICKER_KILL_GRACE_PERIOD_MS);
+        request->picker_pidfd = -1;
+    }
+}
 
-static int method_close(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+int method_request_close(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
     struct filechooser_request *request = data;
     int ret = 0;
     log_print(DEBUG, "request closed");
 
-    if (kill(-request->picker_pid, SIGTERM) < 0) {
-        log_print(WARN, "failed to kill picker: %s", strerror(errno));
-    };
+    request_stop_picker(request);
 
     sd_bus_message *reply = NULL;
     if ((ret = sd_bus_message_new_method_return(msg, &reply)) < 0) {
@@ -39,6 +72,7 @@ static int method_close(sd_bus_message *msg, void *data, sd_bus_error *ret_error
         log_print(ERROR, "sd_bus_send() failed: %s", strerror(-ret));
         return ret;
     }
+    dbus_schedule_flush(request->xdptf);
     sd_bus_message_unref(reply);
 
     filechooser_request_cleanup(request);
@@ -46,14 +80,27 @@ static int method_close(sd_bus_message *msg, void *data, sd_bus_error *ret_error
     return 0;
 }
 
-static const sd_bus_vtable request_vtable[] = {
-    SD_BUS_VTABLE_START(0),
-    SD_BUS_METHOD("Close", "", "", method_close, SD_BUS_VTABLE_UNPRIVILEGED),
-    SD_BUS_VTABLE_END
-};
+/* discards whatever was appended to reply so far */
+static int request_restart_reply(struct filechooser_request *request) {
+    int ret = 0;
+
+    sd_bus_message_unref(request->response.message);
+    request->response.message = NULL;
+    request->response.started = false;
+    if ((ret = sd_bus_message_new_method_return(request->response.call,
+                                                &request->response.message)) < 0) {
+        log_print(ERROR, "sd_bus_message_new_method_return() failed: %s", strerror(-ret));
+    }
+
+    return ret;
+}
 
 static int send_response_error(struct filechooser_request *request) {
     int ret = 0;
+
+    if (request->response.started && (ret = request_restart_reply(request)) < 0) {
+        goto out;
+    }
     struct sd_bus_message *reply = request->response.message;
 
     if ((ret = sd_bus_message_append(reply, "u", PORTAL_RESPONSE_ENDED, 1)) < 0) {
@@ -72,10 +119,12 @@ static int send_response_error(struct filechooser_request *request) {
         log_print(ERROR, "sd_bus_send() failed: %s", strerror(-ret));
         goto out;
     }
+    dbus_schedule_flush(request->xdptf);
 out:
     return ret;
 }
 
+/* reply must not be started, it is only started with the first uri */
 static int send_response_cancelled(struct filechooser_request *request) {
     int ret = 0;
     struct sd_bus_message *reply = request->response.message;
@@ -96,11 +145,13 @@ static int send_response_cancelled(struct filechooser_request *request) {
         log_print(ERROR, "sd_bus_send() failed: %s", strerror(-ret));
         goto out;
     }
+    dbus_schedule_flush(request->xdptf);
 out:
     return ret;
 }
 
-static int send_response_success(struct filechooser_request *request) {
+/* appends everything up to the uri array to reply */
+static int request_start_reply(struct filechooser_request *request) {
     int ret = 0;
     struct sd_bus_message *reply = request->response.message;
 
@@ -124,325 +175,1092 @@ static int send_response_success(struct filechooser_request *request) {
         log_print(ERROR, "sd_bus_message_open_container() failed: %s", strerror(-ret));
         goto out;
     }
-    if ((ret = sd_bus_message_append_strv(reply, request->response.uris)) < 0) {
-        log_print(ERROR, "sd_bus_message_append_strv() failed: %s", strerror(-ret));
+    if ((ret = sd_bus_message_open_container(reply, 'a', "s")) < 0) {
+        log_print(ERROR, "sd_bus_message_open_container() failed: %s", strerror(-ret));
         goto out;
     }
-    if ((ret = sd_bus_message_close_container(reply)) < 0) {
-        log_print(ERROR, "sd_bus_message_close_container() failed: %s", strerror(-ret));
-        goto out;
+    request->response.started = true;
+out:
+    return ret;
+}
+
+/* appends uri in request->response.uri to reply */
+static void request_append_uri(struct filechooser_request *request) {
+    int ret = 0;
+
+    if (request->response.broken) {
+        return;
     }
-    if ((ret = sd_bus_message_close_container(reply)) < 0) {
-        log_print(ERROR, "sd_bus_message_close_container() failed: %s", strerror(-ret));
-        goto out;
+    if (!request->response.started && (ret = request_start_reply(request)) < 0) {
+        goto err;
     }
-    if ((ret = sd_bus_message_close_container(reply)) < 0) {
-        log_print(ERROR, "sd_bus_message_close_container() failed: %s", strerror(-ret));
-        goto out;
+    if ((ret = sd_bus_message_append_basic(request->response.message, 's',
+                                           request->response.uri.data)) < 0) {
+        log_print(ERROR, "sd_bus_message_append_basic() failed: %s", strerror(-ret));
+        goto err;
+    }
+    request->response.n_uris += 1;
+    return;
+
+err:
+    request->response.broken = true;
+}
+
+/* closes everything request_start_reply() opened and sends reply */
+static int send_response_success(struct filechooser_request *request) {
+    int ret = 0;
+    struct sd_bus_message *reply = request->response.message;
+
+    /* array, variant, dict entry, dict */
+    for (int i = 0; i < 4; i++) {
+        if ((ret = sd_bus_message_close_container(reply)) < 0) {
+            log_print(ERROR, "sd_bus_message_close_container() failed: %s", strerror(-ret));
+            goto out;
+        }
     }
     if ((ret = sd_bus_send(NULL, reply, NULL)) < 0) {
         log_print(ERROR, "sd_bus_send() failed: %s", strerror(-ret));
         goto out;
     }
+    dbus_schedule_flush(request->xdptf);
 out:
     return ret;
 }
 
-int filechooser_request_finalize(struct filechooser_request *request) {
-    /* TODO: check number of uris returned when only one uri is needed */
-    char **uris;
-    int n_uris = get_uris_from_string(request->buffer.data, &uris);
+/* paths are checked in batches, so checking starts while picker is still writing */
+#define REQUEST_BATCH_SIZE 1024
+
+/* batches and their paths are in request arena, so they cost no malloc of their own */
+struct request_batch {
+    struct validator_job job;
+    struct filechooser_request *request;
+    struct path_check checks[REQUEST_BATCH_SIZE];
+    TAILQ_ENTRY(request_batch) link;
+};
 
-    log_print(DEBUG, "got %d uris", n_uris);
+/* adds path that passed the checks to the reply */
+static void request_add_checked_path(struct filechooser_request *request,
+                                     const char *path, size_t len) {
+    if (request->type == SAVE_FILES) {
+        /* uris are built from it at the end */
+        request->response.folder = arena_strndup(request->arena, path, len);
+        return;
+    }
+
+    bool multiple = (request->type == OPEN_FILE && request->data.open_file.multiple);
+    if (!multiple && request->response.n_uris > 0) {
+        request->response.n_extra += 1;
+        return;
+    }
+
+    ds_truncate(&request->response.uri, 0);
+    uri_append_path(&request->response.uri, path, len);
+    request_append_uri(request);
+}
+
+/*
+ * for SaveFiles, picker returns a single folder, and there is one uri
+ * for every requested file in it.
+ */
+static void request_add_save_files_uris(struct filechooser_request *request) {
+    char *folder = request->response.folder;
+    if (folder == NULL) {
+        return;
+    }
+
+    if (folder[0] != '/') {
+        log_print(WARN, "picker returned \"%s\" for SaveFiles, expected absolute path", folder);
+        return;
+    }
+
+    /* directory part is the same for every uri, encode it once */
+    struct ds *uri = &request->response.uri;
+    ds_truncate(uri, 0);
+    uri_append_path(uri, folder, strlen(folder));
+    /* root directory already ends with slash */
+    if (uri->data[uri->length - 1] != '/') {
+        ds_append_bytes(uri, "/", 1);
+    }
+    size_t dir_len = uri->length;
+
+    for (char **file = request->data.save_files.files; *file != NULL; file++) {
+        ds_truncate(uri, dir_len);
+        uri_append_encoded(uri, *file, strlen(*file));
+        request_append_uri(request);
+    }
+}
+
+/* returns why path picker returned can't be given to the app, NULL if it can */
+static const char *request_check_path(struct filechooser_request *request,
+                                      const struct path_check *check) {
+    if (check->path[0] != '/') {
+        return "not an absolute path";
+    }
+    if (request->type == SAVE_FILE && check->error == -ENOENT) {
+        /* file is going to be created */
+        return NULL;
+    }
+    if (check->error < 0) {
+        return strerror(-check->error);
+    }
+
+    bool want_dir = (request->type == SAVE_FILES) ||
+        (request->type == OPEN_FILE && request->data.open_file.directory);
+    if (check->is_dir && !want_dir) {
+        return "is a directory";
+    } else if (!check->is_dir && want_dir) {
+        return "not a directory";
+    }
+
+    if (request->filter != NULL) {
+        const char *name = strrchr(check->path, '/') + 1;
+        if (!filter_matcher_match(request->filter, name, strlen(name))) {
+            return "doesn't match any of the filters";
+        }
+    }
+    return NULL;
+}
+
+/* adds path to the reply if it passed the checks, drops it otherwise */
+static void request_take_checked_path(struct filechooser_request *request,
+                                      const struct path_check *check) {
+    const char *reason = request_check_path(request, check);
+    if (reason != NULL) {
+        log_print(DEBUG, "picker returned \"%s\": %s, dropping it", check->path, reason);
+        request->response.n_dropped += 1;
+        return;
+    }
+    request_add_checked_path(request, check->path, strlen(check->path));
+}
+
+/* sends response with uris that were added and cleans up the request */
+static int request_send_result(struct filechooser_request *request) {
+    if (request->type == SAVE_FILES) {
+        request_add_save_files_uris(request);
+    }
+
+    if (request->response.n_dropped > 0) {
+        log_print(WARN, "dropped %d paths that failed the checks", request->response.n_dropped);
+    }
+    if (request->response.n_extra > 0) {
+        log_print(WARN, "picker returned %d paths, but only one was requested, using the first one",
+                  request->response.n_extra + 1);
+    }
+
+    log_print(DEBUG, "got %d uris", request->response.n_uris);
 
     int ret;
-    if (n_uris == 0) {
+    if (request->response.broken) {
+        ret = send_response_error(request);
+    } else if (request->response.n_uris == 0) {
         ret = send_response_cancelled(request);
     } else {
-        request->response.n_uris = n_uris;
-        request->response.uris = uris;
         ret = send_response_success(request);
     }
+    if (ret >= 0) {
+        request->timestamps[STAGE_REPLIED] = stats_now();
+    }
 
     filechooser_request_cleanup(request);
 
     return ret;
 }
 
-static int request_fd_event_handler(struct pollen_callback *callback,
-                                    int fd, uint32_t events, void *data) {
-    struct filechooser_request *request = data;
+static void request_batch_done(struct validator_job *job, void *data) {
+    struct request_batch *batch = data;
+
+    struct filechooser_request *request = batch->request;
+    if (job->cancelled) {
+        /* request was cleaned up while validator was checking the batch, only arena is left */
+        request->n_cancelled_batches -= 1;
+        if (request->n_cancelled_batches == 0) {
+            arena_destroy(request->arena);
+        }
+        return;
+    }
+
+    TAILQ_REMOVE(&request->batches, batch, link);
+
+    for (int i = 0; i < job->n_checks; i++) {
+        request_take_checked_path(request, &job->checks[i]);
+    }
+
+    if (request->picker_done && TAILQ_EMPTY(&request->batches)) {
+        request_send_result(request);
+    }
+}
+
+static void request_submit_batch(struct filechooser_request *request) {
+    struct request_batch *batch = request->batch;
+    request->batch = NULL;
+
+    batch->job.checks = batch->checks;
+    batch->job.done = request_batch_done;
+    batch->job.data = batch;
+
+    TAILQ_INSERT_TAIL(&request->batches, batch, link);
+    validator_submit(&request->xdptf->validator, &batch->job);
+}
+
+int filechooser_buffered_add(struct xdptf *xdptf, size_t len) {
+    size_t max_buffered_bytes = (size_t)xdptf->config.max_buffered_size * 1024;
+
+    if (max_buffered_bytes > 0 && xdptf->buffered_bytes + len > max_buffered_bytes) {
+        log_print(WARN, "pickers of all requests returned more than %d KiB",
+                  xdptf->config.max_buffered_size);
+        stats_add_over_limit(&xdptf->stats);
+        return -ENOBUFS;
+    }
+
+    xdptf->buffered_bytes += len;
+    stats_buffered_changed(&xdptf->stats, xdptf->buffered_bytes);
+    return 0;
+}
+
+void filechooser_buffered_release(struct xdptf *xdptf, size_t len) {
+    xdptf->buffered_bytes -= len;
+    stats_buffered_changed(&xdptf->stats, xdptf->buffered_bytes);
+}
+
+int filechooser_request_add_output(struct filechooser_request *request, size_t len) {
+    struct xdptf *xdptf = request->xdptf;
+    size_t max_result_bytes = (size_t)xdptf->config.max_result_size * 1024;
+
+    if (max_result_bytes > 0 && request->n_bytes + len > max_result_bytes) {
+        log_print(WARN, "picker returned more than %d KiB", xdptf->config.max_result_size);
+        stats_add_over_limit(&xdptf->stats);
+        return -ENOBUFS;
+    }
+    int ret = filechooser_buffered_add(xdptf, len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    request->n_bytes += len;
+    return 0;
+}
+
+int filechooser_request_add_path(struct filechooser_request *request,
+                                 const char *path, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    /* picker returns a single folder for SaveFiles, only first line matters */
+    if (request->type == SAVE_FILES && request->n_paths > 0) {
+        return 0;
+    }
+    int max_result_paths = request->xdptf->config.max_result_paths;
+    if (max_result_paths > 0 && request->n_paths >= max_result_paths) {
+        log_print(WARN, "picker returned more than %d paths", max_result_paths);
+        stats_add_over_limit(&request->xdptf->stats);
+        return -ENOBUFS;
+    }
+    request->n_paths += 1;
+
+    if (!request->xdptf->validator.running) {
+        /* there is no thread to check it on, it's checked right here */
+        struct path_check check = { .path = arena_strndup(request->arena, path, len) };
+        validator_check_path(&check);
+        request_take_checked_path(request, &check);
+        return 0;
+    }
+
+    if (request->batch == NULL) {
+        request->batch = arena_alloc(request->arena, sizeof(*request->batch));
+        request->batch->request = request;
+        request->batch->job.n_checks = 0;
+    }
+    struct request_batch *batch = request->batch;
+    batch->checks[batch->job.n_checks].path = arena_strndup(request->arena, path, len);
+    batch->job.n_checks += 1;
+
+    if (batch->job.n_checks == REQUEST_BATCH_SIZE) {
+        request_submit_batch(request);
+    }
+    return 0;
+}
+
+/*
+ * adds every complete path from request buffer, only incomplete last one
+ * is left there. there are no delimiters before scan_from.
+ * returns negative errno if path couldn't be added.
+ */
+static int request_parse_buffer(struct filechooser_request *request, size_t scan_from) {
+    char delimiter = request->xdptf->config.null_delimited ? '\0' : '\n';
+    char *data = request->buffer.data;
+    char *end = data + request->buffer.length;
+    char *path = data;
+    char *pos = data + scan_from;
+    char *path_end;
+    int ret = 0;
+    while ((path_end = memchr(pos, delimiter, end - pos)) != NULL) {
+        if ((ret = filechooser_request_add_path(request, path, path_end - path)) < 0) {
+            break;
+        }
+        path = pos = path_end + 1;
+    }
+    ds_consume(&request->buffer, path - data);
+    return ret;
+}
+
+/*
+ * adds paths picker wrote to result memfd. it's sealed first, so picker
+ * (or anything it left running) can't change or truncate it while it's mapped,
+ * and then paths are taken right from the mapping.
+ * returns negative errno on failure.
+ */
+static int request_read_result_memfd(struct filechooser_request *request) {
+    int fd = request->result_fd;
+
+    /*
+     * sealed before its size is taken, so picker can't shrink it under our mapping.
+     * EBUSY means someone still has it mapped for writing.
+     */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        return -errno;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return -errno;
+    }
+    if (sb.st_size == 0) {
+        /* picker used the pipe */
+        return 0;
+    }
+    int ret = filechooser_request_add_output(request, sb.st_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    size_t size = sb.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return -errno;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    log_print(DEBUG, "picker wrote %zu bytes to result memfd", size);
+
+    char delimiter = request->xdptf->config.null_delimited ? '\0' : '\n';
+    const char *path = data;
+    const char *end = data + size;
+    while (path < end) {
+        const char *path_end = memchr(path, delimiter, end - path);
+        /* last path doesn't have to be terminated */
+        if (path_end == NULL) {
+            path_end = end;
+        }
+        if ((ret = filechooser_request_add_path(request, path, path_end - path)) < 0) {
+            break;
+        }
+        path = path_end + 1;
+    }
+
+    munmap(data, size);
+    return ret;
+}
+
+int filechooser_request_finalize(struct filechooser_request *request) {
+    if (request->timestamps[STAGE_EOF] == 0) {
+        request->timestamps[STAGE_EOF] = stats_now();
+    }
+
+    /* last path doesn't have to be terminated */
+    if (request->buffer.length > 0) {
+        int ret = filechooser_request_add_path(request, request->buffer.data,
+                                               request->buffer.length);
+        if (ret < 0) {
+            return filechooser_request_end(request);
+        }
+        ds_consume(&request->buffer, request->buffer.length);
+    }
+
+    /* picker is done writing, pipe is closed with the callback */
+    if (request->event_loop_callback != NULL) {
+        pollen_loop_remove_callback(request->event_loop_callback);
+        request->event_loop_callback = NULL;
+        request->pipe_fd = -1;
+    }
+
+    if (request->result_fd >= 0) {
+        int ret = request_read_result_memfd(request);
+        if (ret == -EBUSY && request->pidfd_callback != NULL) {
+            /* picker closed fd 4 with result still mapped, it's read once picker exits */
+            log_print(DEBUG, "result memfd of picker %d is still mapped, waiting for it to exit",
+                      request->picker_pid);
+            return 0;
+        } else if (ret == -EBUSY) {
+            log_print(WARN, "result memfd is still mapped for writing after picker exited, "
+                      "ending request");
+            return filechooser_request_end(request);
+        } else if (ret == -ENOBUFS) {
+            return filechooser_request_end(request);
+        } else if (ret < 0) {
+            log_print(ERROR, "failed to read result memfd (fd %d): %s",
+                      request->result_fd, strerror(-ret));
+            request->response.broken = true;
+        }
+        close(request->result_fd);
+        request->result_fd = -1;
+    }
+
+    if (request->batch != NULL) {
+        request_submit_batch(request);
+    }
+    request->picker_done = true;
+    if (!TAILQ_EMPTY(&request->batches)) {
+        /* response is sent when the last batch is checked */
+        return 0;
+    }
+
+    return request_send_result(request);
+}
+
+int filechooser_request_fail(struct filechooser_request *request) {
+    int ret = send_response_error(request);
+    if (ret >= 0) {
+        request->timestamps[STAGE_REPLIED] = stats_now();
+    }
+    filechooser_request_cleanup(request);
+    return ret;
+}
+
+int filechooser_request_end(struct filechooser_request *request) {
+    request_stop_picker(request);
+    return filechooser_request_fail(request);
+}
+
+/*
+ * returns 1 on EOF, 0 if there is no more data to read right now, negative errno on error.
+ * -ENOBUFS means picker output went over limits, see filechooser_request_add_output().
+ */
+static int request_read_pipe(struct filechooser_request *request) {
+    int fd = request->pipe_fd;
 
-    static char buf[4096];
     ssize_t bytes_read;
     while (true) {
-        bytes_read = read(fd, buf, sizeof(buf));
+        /* read straight into the buffer, after incomplete path from previous read */
+        size_t old_length = request->buffer.length;
+        char *dst = ds_reserve(&request->buffer, request->read_size);
+        bytes_read = read(fd, dst, request->read_size);
         if (bytes_read > 0) {
-            ds_append_bytes(&request->buffer, buf, bytes_read);
+            if (request->timestamps[STAGE_FIRST_BYTE] == 0) {
+                request->timestamps[STAGE_FIRST_BYTE] = stats_now();
+            }
+            ds_commit(&request->buffer, bytes_read);
+            int ret = filechooser_request_add_output(request, bytes_read);
+            if (ret < 0 || (ret = request_parse_buffer(request, old_length)) < 0) {
+                return ret;
+            }
+            /* picker has a lot to say, take bigger bites */
+            if ((size_t)bytes_read == request->read_size && request->read_size < REQUEST_READ_MAX) {
+                request->read_size *= 2;
+            }
         } else if (bytes_read == 0) {
             /* EOF */
             log_print(DEBUG, "EOF on pipe fd %d", fd);
-            return filechooser_request_finalize(request);
+            request->timestamps[STAGE_EOF] = stats_now();
+            return 1;
         } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
             /* no more data to read */
             return 0;
         } else {
+            int ret = -errno;
             log_print(ERROR, "failed to read from pipe (fd %d): %s", fd, strerror(errno));
-            send_response_error(request);
-            filechooser_request_cleanup(request);
-            return -1;
+            return ret;
         }
     }
 }
 
-int method_save_file(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
-    struct xdptf *xdptf = data;
+static int request_fd_event_handler(struct pollen_callback *callback,
+                                    int fd, uint32_t events, void *data) {
+    struct filechooser_request *request = data;
 
-    int ret = 0;
+    int ret = request_read_pipe(request);
+    if (ret > 0) {
+        return filechooser_request_finalize(request);
+    } else if (ret == -ENOBUFS) {
+        /* not an error of the daemon itself, keep going */
+        filechooser_request_end(request);
+        return 0;
+    } else if (ret < 0) {
+        filechooser_request_fail(request);
+        return -1;
+    }
 
-    char *handle, *app_id, *parent_window, *title;
-    char *current_folder = NULL;
-    char *current_name = NULL;
+    return 0;
+}
 
-    log_print(DEBUG, "save_file_handler: fired");
+static int request_pidfd_event_handler(struct pollen_callback *callback,
+                                       int fd, uint32_t events, void *data) {
+    struct filechooser_request *request = data;
 
-    if ((ret = sd_bus_message_read(msg, "osss", &handle, &app_id, &parent_window, &title)) < 0) {
-        log_print(ERROR, "save_file_handler: sd_bus_message_read() failed");
-        goto err;
-    };
-    log_print(DEBUG, "save_file_handler: handle = %s", handle);
-    log_print(DEBUG, "save_file_handler: app_id = %s", app_id);
-    log_print(DEBUG, "save_file_handler: parent_window = %s", parent_window);
-    log_print(DEBUG, "save_file_handler: title = %s", title);
+    int ret = reap_picker(fd);
+    if (ret == -EAGAIN) {
+        return 0;
+    } else if (ret < 0) {
+        log_print(WARN, "failed to reap picker %d: %s", request->picker_pid, strerror(-ret));
+    }
+    request->picker_reaped = true;
+    request->timestamps[STAGE_REAPED] = stats_now();
+    /* pidfd stays readable, it's closed in cleanup */
+    pollen_loop_remove_callback(request->pidfd_callback);
+    request->pidfd_callback = NULL;
+
+    if (request->picker_done) {
+        /* EOF on pipe came first, paths are being checked already */
+        log_print(DEBUG, "picker %d exited", request->picker_pid);
+        return 0;
+    }
 
-    if ((ret = sd_bus_message_enter_container(msg, 'a', "{sv}")) < 0) {
-        log_print(ERROR, "save_file_handler: sd_bus_message_enter_container() failed");
-        goto err;
+    log_print(DEBUG, "picker %d exited, finalizing request", request->picker_pid);
+
+    /* picker might have written something right before exiting. no pipe if EOF came first */
+    ret = (request->pipe_fd >= 0) ? request_read_pipe(request) : 0;
+    if (ret == -ENOBUFS) {
+        filechooser_request_end(request);
+        return 0;
+    } else if (ret < 0) {
+        filechooser_request_fail(request);
+        return -1;
     }
-    while (sd_bus_message_enter_container(msg, 'e', "sv") > 0) {
-        char *key;
 
-        if ((ret = sd_bus_message_read(msg, "s", &key)) < 0) {
-            log_print(ERROR, "save_file_handler: sd_bus_message_read() failed");
-            goto err;
-        }
+    return filechooser_request_finalize(request);
+}
 
-        /* TODO: also get current_file */
-        if (strcmp(key, "current_name") == 0) {
-            sd_bus_message_read(msg, "v", "s", &current_name);
-            log_print(DEBUG, "save_file_handler: option current_name = %s", current_name);
-        } else if (strcmp(key, "current_folder") == 0) {
-            const void *ptr = NULL;
-            size_t size = 0;
-            if ((ret = sd_bus_message_enter_container(msg, 'v', "ay")) < 0) {
-                log_print(ERROR, "save_file_handler: sd_bus_message_enter_container() failed");
-                goto err;
-            }
-            if ((ret = sd_bus_message_read_array(msg, 'y', &ptr, &size)) < 0) {
-                log_print(ERROR, "save_file_handler: sd_bus_message_read_array() failed");
-                goto err;
-            }
-            current_folder = (char *)ptr;
-            log_print(DEBUG, "save_file_handler: option current_folder = %s", current_folder);
-        } else {
-            log_print(DEBUG, "save_file_handler: option %s IGNORED", key);
-            if ((ret = sd_bus_message_skip(msg, "v")) < 0) {
-                log_print(ERROR, "save_file_handler: sd_bus_message_skip() failed");
-                goto err;
-            }
-        }
+static int request_timeout_handler(struct pollen_callback *callback, void *data) {
+    struct filechooser_request *request = data;
 
-        if ((ret = sd_bus_message_exit_container(msg)) < 0) {
-            log_print(ERROR, "save_file_handler: sd_bus_message_exit_container() failed");
-            goto err;
-        }
+    log_print(WARN, "request timed out after %d seconds, ending it",
+              request->xdptf->config.request_timeout);
+
+    filechooser_request_end(request);
+    return 0;
+}
+
+static void record_add_common_options(struct ds *record, int modal, const char *accept_label) {
+    record_add_int(record, "modal", modal);
+    if (accept_label != NULL) {
+        record_add(record, "accept_label", accept_label);
     }
+}
 
-    sd_bus_message *response;
-    if ((ret = sd_bus_message_new_method_return(msg, &response)) < 0) {
-        log_print(ERROR, "sd_bus_message_new_method_return() failed: %s", strerror(-ret));
-        goto err;
+/* only the filter picker should start with, current_filter or the first one */
+static void record_add_filter(struct ds *record, struct mime_db *mime,
+                              const struct option_filter_list *filters,
+                              const struct option_filter *current_filter) {
+    if (current_filter != NULL) {
+        filter_add_to_record(record, mime, current_filter);
+    } else if (filters->n_filters > 0) {
+        filter_add_to_record(record, mime, &filters->filters[0]);
     }
+}
+
+void filechooser_request_build_record(struct filechooser_request *request, struct ds *record) {
+    record_add_int(record, "type", request->type);
+    record_add(record, "app_id", request->app_id);
+    record_add(record, "parent_window", request->parent_window);
+    record_add(record, "title", request->title);
+
+    /* unlike argv, keys for options that app didn't provide are omitted */
+    switch (request->type) {
+    case SAVE_FILE: {
+        struct save_file_request_data *data = &request->data.save_file;
+        if (data->current_folder != NULL) {
+            record_add(record, "folder", data->current_folder);
+        }
+        if (data->current_name != NULL) {
+            record_add(record, "name", data->current_name);
+        }
+        if (data->current_file != NULL) {
+            record_add(record, "current_file", data->current_file);
+        }
+        record_add_filter(record, &request->xdptf->mime, &data->filters, data->current_filter);
+        record_add_common_options(record, data->modal, data->accept_label);
+        break;
+    }
+    case SAVE_FILES: {
+        struct save_files_request_data *data = &request->data.save_files;
+        if (data->current_folder != NULL) {
+            record_add(record, "folder", data->current_folder);
+        }
+        for (char **file = data->files; *file != NULL; file++) {
+            record_add(record, "file", *file);
+        }
+        record_add_common_options(record, data->modal, data->accept_label);
+        break;
+    }
+    case OPEN_FILE: {
+        struct open_file_request_data *data = &request->data.open_file;
+        if (data->current_folder != NULL) {
+            record_add(record, "folder", data->current_folder);
+        }
+        record_add_int(record, "multiple", data->multiple);
+        record_add_int(record, "directory", data->directory);
+        record_add_filter(record, &request->xdptf->mime, &data->filters, data->current_filter);
+        record_add_common_options(record, data->modal, data->accept_label);
+        break;
+    }
+    default:
+        log_print(ERROR, "UNREACHABLE: illegal request type");
+        abort();
+    }
+}
+
+/* starts picker process for request, or hands it to a pooled one */
+static int request_spawn_picker(struct filechooser_request *request) {
+    struct xdptf *xdptf = request->xdptf;
+    void *request_data = &request->data;
+    int ret = 0;
 
-    struct save_file_request_data request_data = {
-        .current_folder = current_folder,
-        .current_name = current_name,
-    };
     pid_t child_pid;
-    ret = exec_picker(xdptf->config.picker_cmd, SAVE_FILE, &request_data, &child_pid);
+    int child_pidfd;
+    /* SaveFiles always needs record, that's where the list of files is */
+    bool with_record = xdptf->config.request_record || request->type == SAVE_FILES;
+    struct ds record;
+    ds_init(&record);
+    if (with_record) {
+        filechooser_request_build_record(request, &record);
+    }
+    ret = pool_exec_picker(&xdptf->pool, request->type, request_data,
+                           with_record ? &record : NULL,
+                           xdptf->config.result_memfd ? &request->result_fd : NULL,
+                           &child_pid, &child_pidfd);
+    ds_free(&record);
     if (ret < 0) {
-        log_print(ERROR, "exec_picker() failed: %s", strerror(-ret));
-        goto err;
+        log_print(ERROR, "pool_exec_picker() failed: %s", strerror(-ret));
+        return ret;
     }
-    int pipe_fd = ret;
+    request->timestamps[STAGE_SPAWNED] = stats_now();
+    request->pipe_fd = ret;
 
-    struct filechooser_request *new_request = xcalloc(1, sizeof(*new_request));
-    ds_init(&new_request->buffer);
-    new_request->type = SAVE_FILE;
-    new_request->response.message = response;
-    new_request->pipe_fd = pipe_fd;
-    new_request->picker_pid = child_pid;
+    /* default 64 KiB pipe means a wakeup per 64 KiB of paths, let picker write more at once */
+    if (request->type == OPEN_FILE && request->data.open_file.multiple &&
+            fcntl(request->pipe_fd, F_SETPIPE_SZ, REQUEST_PIPE_SIZE) < 0) {
+        log_print(DEBUG, "failed to enlarge pipe (fd %d): %s", request->pipe_fd, strerror(errno));
+    }
+    request->picker_pid = child_pid;
+    request->picker_pidfd = child_pidfd;
 
-    if ((ret = sd_bus_add_object_vtable(sd_bus_message_get_bus(msg), &new_request->slot, handle,
-                                        interface_name, request_vtable, new_request)) < 0) {
-        log_print(ERROR, "sd_bus_add_object_vtable() failed: %s", strerror(-ret));
-        free(new_request);
-        goto err;
+    request->event_loop_callback = pollen_loop_add_fd(xdptf->event_loop,
+                                                      request->pipe_fd, EPOLLIN, true,
+                                                      request_fd_event_handler, request);
+    request->pidfd_callback = pollen_loop_add_fd(xdptf->event_loop,
+                                                 request->picker_pidfd, EPOLLIN, false,
+                                                 request_pidfd_event_handler, request);
+
+    return 0;
+}
+
+static int request_start_picker(struct filechooser_request *request) {
+    struct xdptf *xdptf = request->xdptf;
+    int ret = 0;
+
+    request->timestamps[STAGE_SPAWN_STARTED] = stats_now();
+
+    if (xdptf->remote.socket_path != NULL) {
+        if ((ret = remote_send_request(&xdptf->remote, request)) == 0) {
+            request->timestamps[STAGE_SPAWNED] = stats_now();
+            request->started = true;
+            xdptf->n_running += 1;
+            return 0;
+        }
+        log_print(WARN, "failed to send request to picker server, starting picker instead");
     }
 
-    LIST_INSERT_HEAD(&xdptf->requests, new_request, link);
+    if ((ret = request_spawn_picker(request)) < 0) {
+        return ret;
+    }
+    request->started = true;
+    xdptf->n_running += 1;
 
-    new_request->event_loop_callback = pollen_loop_add_fd(xdptf->event_loop,
-                                                          new_request->pipe_fd, EPOLLIN, true,
-                                                          request_fd_event_handler, new_request);
+    return 0;
+}
 
-    return 1; /* async */
+int filechooser_request_start_local(struct filechooser_request *request) {
+    log_print(WARN, "picker server didn't take the request, starting picker instead");
+
+    int ret = request_spawn_picker(request);
+    if (ret < 0) {
+        filechooser_request_fail(request);
+    }
 
-err:
     return ret;
 }
 
-int method_open_file(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
-    struct xdptf *xdptf = data;
-
-    int ret = 0;
+static bool request_under_limits(struct filechooser_request *request) {
+    struct xdptf *xdptf = request->xdptf;
+    int max_pickers = xdptf->config.max_pickers;
+    int max_pickers_per_app = xdptf->config.max_pickers_per_app;
 
-    char *handle, *app_id, *parent_window, *title;
-    char *current_folder = NULL;
-    int multiple = false;
-    int directory = false;
+    if (max_pickers > 0 && xdptf->n_running >= max_pickers) {
+        return false;
+    }
+    if (max_pickers_per_app > 0) {
+        int n_running_for_app = 0;
+        struct filechooser_request *other;
+        LIST_FOREACH(other, &xdptf->requests, link) {
+            if (other->started && strcmp(other->app_id, request->app_id) == 0) {
+                n_running_for_app += 1;
+            }
+        }
+        if (n_running_for_app >= max_pickers_per_app) {
+            return false;
+        }
+    }
 
-    log_print(DEBUG, "method_open_file: fired");
+    return true;
+}
 
-    if ((ret = sd_bus_message_read(msg, "osss", &handle, &app_id, &parent_window, &title)) < 0) {
-        log_print(ERROR, "method_open_file: sd_bus_message_read() failed");
-        goto err;
-    };
-    log_print(DEBUG, "method_open_file: handle = %s", handle);
-    log_print(DEBUG, "method_open_file: app_id = %s", app_id);
-    log_print(DEBUG, "method_open_file: parent_window = %s", parent_window);
-    log_print(DEBUG, "method_open_file: title = %s", title);
+static int request_dequeue_callback(struct pollen_callback *callback, void *data) {
+    struct xdptf *xdptf = data;
 
-    if ((ret = sd_bus_message_enter_container(msg, 'a', "{sv}")) < 0) {
-        log_print(ERROR, "method_open_file: sd_bus_message_enter_container() failed");
-        goto err;
-    }
-    while (sd_bus_message_enter_container(msg, 'e', "sv") > 0) {
-        char *key;
+    pollen_loop_remove_callback(xdptf->dequeue_callback);
+    xdptf->dequeue_callback = NULL;
 
-        if ((ret = sd_bus_message_read(msg, "s", &key)) < 0) {
-            log_print(ERROR, "method_open_file: sd_bus_message_read() failed");
-            goto err;
+    /* oldest first, but don't let an app at its own limit hold up everyone else */
+    struct filechooser_request *request, *request_tmp;
+    TAILQ_FOREACH_SAFE(request, &xdptf->queued_requests, queue_link, request_tmp) {
+        if (xdptf->config.max_pickers > 0 && xdptf->n_running >= xdptf->config.max_pickers) {
+            break;
         }
-
-        if (strcmp(key, "current_folder") == 0) {
-            const void *ptr = NULL;
-            size_t size = 0;
-            if ((ret = sd_bus_message_enter_container(msg, 'v', "ay")) < 0) {
-                log_print(ERROR, "method_open_file: sd_bus_message_enter_container() failed");
-                goto err;
-            }
-            if ((ret = sd_bus_message_read_array(msg, 'y', &ptr, &size)) < 0) {
-                log_print(ERROR, "method_open_file: sd_bus_message_read_array() failed");
-                goto err;
-            }
-            current_folder = (char *)ptr;
-            log_print(DEBUG, "method_open_file: option current_folder = %s", current_folder);
-        } else if (strcmp(key, "multiple") == 0) {
-            if ((ret = sd_bus_message_read(msg, "v", "b", &multiple)) < 0) {
-                log_print(ERROR, "method_open_file: sd_bus_message_read() failed");
-                goto err;
-            }
-            log_print(DEBUG, "method_open_file: option multiple = %d", multiple);
-        } else if (strcmp(key, "directory") == 0) {
-            if ((ret = sd_bus_message_read(msg, "v", "b", &directory)) < 0) {
-                log_print(ERROR, "method_open_file: sd_bus_message_read() failed");
-                goto err;
-            }
-            log_print(DEBUG, "method_open_file: option directory = %d", directory);
-        } else {
-            log_print(DEBUG, "method_open_file: option %s IGNORED", key);
-            if ((ret = sd_bus_message_skip(msg, "v")) < 0) {
-                log_print(ERROR, "method_open_file: sd_bus_message_skip() failed");
-                goto err;
-            }
+        if (!request_under_limits(request)) {
+            continue;
         }
 
-        if ((ret = sd_bus_message_exit_container(msg)) < 0) {
-            log_print(ERROR, "method_open_file: sd_bus_message_exit_container() failed");
-            goto err;
+        TAILQ_REMOVE(&xdptf->queued_requests, request, queue_link);
+        request->queued = false;
+        xdptf->n_queued -= 1;
+        stats_queue_changed(&xdptf->stats, xdptf->n_queued);
+        request->timestamps[STAGE_DEQUEUED] = stats_now();
+
+        log_print(DEBUG, "starting queued request, %d left in queue", xdptf->n_queued);
+        if (request_start_picker(request) < 0) {
+            filechooser_request_fail(request);
         }
     }
 
+    return 0;
+}
+
+/* picker slot was freed, start queued requests once current event is handled */
+static void request_schedule_dequeue(struct xdptf *xdptf) {
+    if (xdptf->dequeue_callback != NULL || TAILQ_EMPTY(&xdptf->queued_requests)) {
+        return;
+    }
+
+    xdptf->dequeue_callback = pollen_loop_add_idle(xdptf->event_loop, 0,
+                                                   request_dequeue_callback, xdptf);
+    if (xdptf->dequeue_callback == NULL) {
+        log_print(ERROR, "failed to schedule starting queued requests: %s", strerror(errno));
+    }
+}
+
+/*
+ * new_request only has its arena, type and data set, see request_handle_call().
+ * it's destroyed on failure. returns 1 (async method reply) on success, negative errno on failure
+ */
+static int request_start(struct xdptf *xdptf, struct filechooser_request *new_request,
+                         sd_bus_message *msg, uint64_t received,
+                         const char *handle, const char *app_id,
+                         const char *parent_window, const char *title) {
+    int ret = 0;
+    struct arena *arena = new_request->arena;
+
     sd_bus_message *response;
     if ((ret = sd_bus_message_new_method_return(msg, &response)) < 0) {
         log_print(ERROR, "sd_bus_message_new_method_return() failed: %s", strerror(-ret));
-        goto err;
-    }
-
-    struct open_file_request_data request_data = {
-        .current_folder = current_folder,
-        .directory = directory,
-        .multiple = multiple,
-    };
-    pid_t child_pid;
-    ret = exec_picker(xdptf->config.picker_cmd, OPEN_FILE, &request_data, &child_pid);
-    if (ret < 0) {
-        log_print(ERROR, "exec_picker() failed: %s", strerror(-ret));
-        goto err;
+        arena_destroy(arena);
+        return ret;
     }
-    int pipe_fd = ret;
 
-    struct filechooser_request *new_request = xcalloc(1, sizeof(*new_request));
     ds_init(&new_request->buffer);
-    new_request->type = OPEN_FILE;
+    new_request->xdptf = xdptf;
+    new_request->handle = arena_strdup(arena, handle);
+    new_request->app_id = arena_strdup(arena, app_id);
+    new_request->parent_window = arena_strdup(arena, parent_window);
+    new_request->title = arena_strdup(arena, title);
+    new_request->timestamps[STAGE_RECEIVED] = received;
+    new_request->response.call = sd_bus_message_ref(msg);
     new_request->response.message = response;
-    new_request->pipe_fd = pipe_fd;
-    new_request->picker_pid = child_pid;
+    ds_init(&new_request->response.uri);
+    TAILQ_INIT(&new_request->batches);
+    new_request->pipe_fd = -1;
+    new_request->result_fd = -1;
+    new_request->read_size = REQUEST_READ_MIN;
+    new_request->picker_pidfd = -1;
+    LIST_INSERT_HEAD(&xdptf->requests, new_request, link);
 
-    if ((ret = sd_bus_add_object_vtable(sd_bus_message_get_bus(msg), &new_request->slot, handle,
-                                        interface_name, request_vtable, new_request)) < 0) {
-        log_print(ERROR, "sd_bus_add_object_vtable() failed: %s", strerror(-ret));
-        free(new_request);
-        goto err;
+    /* Close is dispatched to the request through dbus fallback vtable, see dbus.c */
+    if ((ret = hashmap_insert(&xdptf->requests_by_handle, new_request->handle, new_request)) < 0) {
+        log_print(ERROR, "request with handle %s already exists", handle);
+        filechooser_request_cleanup(new_request);
+        return ret;
+    }
+    new_request->exported = true;
+    if (strncmp(handle, DBUS_REQUEST_PATH_PREFIX "/", strlen(DBUS_REQUEST_PATH_PREFIX "/")) != 0) {
+        log_print(WARN, "handle %s is not under %s, request can't be closed",
+                  handle, DBUS_REQUEST_PATH_PREFIX);
     }
 
-    LIST_INSERT_HEAD(&xdptf->requests, new_request, link);
+    if (xdptf->config.request_timeout > 0) {
+        new_request->timeout_callback = pollen_loop_add_timer(
+            xdptf->event_loop, xdptf->config.request_timeout * 1000UL,
+            request_timeout_handler, new_request);
+        if (new_request->timeout_callback == NULL) {
+            log_print(WARN, "failed to arm request timeout: %s", strerror(errno));
+        }
+    }
 
-    new_request->event_loop_callback = pollen_loop_add_fd(xdptf->event_loop,
-                                                          new_request->pipe_fd, EPOLLIN, true,
-                                                          request_fd_event_handler, new_request);
+    if (!request_under_limits(new_request)) {
+        if (xdptf->n_queued >= xdptf->config.max_queued_requests) {
+            log_print(WARN, "too many pickers running and %d requests queued, rejecting request",
+                      xdptf->n_queued);
+            stats_add_rejected(&xdptf->stats);
+            filechooser_request_fail(new_request);
+            return 1;
+        }
+
+        TAILQ_INSERT_TAIL(&xdptf->queued_requests, new_request, queue_link);
+        new_request->queued = true;
+        xdptf->n_queued += 1;
+        stats_queue_changed(&xdptf->stats, xdptf->n_queued);
+        log_print(DEBUG, "too many pickers running, request queued at position %d",
+                  xdptf->n_queued);
+        return 1; /* async */
+    }
+
+    if ((ret = request_start_picker(new_request)) < 0) {
+        filechooser_request_cleanup(new_request);
+        return ret;
+    }
 
     return 1; /* async */
+}
 
-err:
-    return ret;
+/* field of request data decoded from an option, see options.h */
+#define OPTION(data, field, signature, decoder) \
+    { signature, offsetof(struct data, field), option_decode_##decoder }
+
+static const struct option_table save_file_options = {
+    .method = "method_save_file",
+    .options = {
+        [OPTION_ACCEPT_LABEL] = OPTION(save_file_request_data, accept_label, "s", string),
+        [OPTION_MODAL] = OPTION(save_file_request_data, modal, "b", bool),
+        [OPTION_FILTERS] = OPTION(save_file_request_data, filters, "a(sa(us))", filters),
+        [OPTION_CURRENT_FILTER] = OPTION(save_file_request_data, current_filter, "(sa(us))", filter),
+        [OPTION_CHOICES] = OPTION(save_file_request_data, choices, "a(ssa(ss)s)", choices),
+        [OPTION_CURRENT_NAME] = OPTION(save_file_request_data, current_name, "s", string),
+        [OPTION_CURRENT_FOLDER] = OPTION(save_file_request_data, current_folder, "ay", bytestring),
+        [OPTION_CURRENT_FILE] = OPTION(save_file_request_data, current_file, "ay", bytestring),
+    },
+};
+
+static const struct option_table save_files_options = {
+    .method = "method_save_files",
+    .options = {
+        [OPTION_ACCEPT_LABEL] = OPTION(save_files_request_data, accept_label, "s", string),
+        [OPTION_MODAL] = OPTION(save_files_request_data, modal, "b", bool),
+        [OPTION_CHOICES] = OPTION(save_files_request_data, choices, "a(ssa(ss)s)", choices),
+        [OPTION_CURRENT_FOLDER] = OPTION(save_files_request_data, current_folder, "ay", bytestring),
+        [OPTION_FILES] = OPTION(save_files_request_data, files, "aay", bytestrings),
+    },
+};
+
+static const struct option_table open_file_options = {
+    .method = "method_open_file",
+    .options = {
+        [OPTION_ACCEPT_LABEL] = OPTION(open_file_request_data, accept_label, "s", string),
+        [OPTION_MODAL] = OPTION(open_file_request_data, modal, "b", bool),
+        [OPTION_MULTIPLE] = OPTION(open_file_request_data, multiple, "b", bool),
+        [OPTION_DIRECTORY] = OPTION(open_file_request_data, directory, "b", bool),
+        [OPTION_FILTERS] = OPTION(open_file_request_data, filters, "a(sa(us))", filters),
+        [OPTION_CURRENT_FILTER] = OPTION(open_file_request_data, current_filter, "(sa(us))", filter),
+        [OPTION_CHOICES] = OPTION(open_file_request_data, choices, "a(ssa(ss)s)", choices),
+        [OPTION_CURRENT_FOLDER] = OPTION(open_file_request_data, current_folder, "ay", bytestring),
+    },
+};
+
+#undef OPTION
+
+static const struct option_table *const option_tables[] = {
+    [SAVE_FILE] = &save_file_options,
+    [SAVE_FILES] = &save_files_options,
+    [OPEN_FILE] = &open_file_options,
+};
+
+/* file names must not escape the folder picked by user */
+static bool is_valid_file_name(const char *name) {
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+           strchr(name, '/') == NULL;
+}
+
+/* checks of decoded options that option tables can't express, returns negative errno if they fail */
+static int request_data_check(struct filechooser_request *request) {
+    if (request->type != SAVE_FILES) {
+        return 0;
+    }
+
+    char **files = request->data.save_files.files;
+    if (files == NULL || files[0] == NULL) {
+        log_print(ERROR, "method_save_files: no files to save");
+        return -EINVAL;
+    }
+    int n_files = 0;
+    for (; files[n_files] != NULL; n_files++) {
+        if (!is_valid_file_name(files[n_files])) {
+            log_print(ERROR, "method_save_files: invalid file name in files");
+            return -EINVAL;
+        }
+    }
+    log_print(DEBUG, "method_save_files: option files has %d files", n_files);
+
+    return 0;
+}
+
+/* common part of all methods, decodes the call into a new request and starts it */
+static int request_handle_call(struct xdptf *xdptf, sd_bus_message *msg,
+                               enum filechooser_request_type type) {
+    const struct option_table *options = option_tables[type];
+
+    int ret = 0;
+    uint64_t received = stats_now();
+
+    char *handle, *app_id, *parent_window, *title;
+
+    log_print(DEBUG, "%s: fired", options->method);
+
+    if ((ret = sd_bus_message_read(msg, "osss", &handle, &app_id, &parent_window, &title)) < 0) {
+        log_print(ERROR, "%s: sd_bus_message_read() failed", options->method);
+        return ret;
+    };
+    log_print(DEBUG, "%s: handle = %s", options->method, handle);
+    log_print(DEBUG, "%s: app_id = %s", options->method, app_id);
+    log_print(DEBUG, "%s: parent_window = %s", options->method, parent_window);
+    log_print(DEBUG, "%s: title = %s", options->method, title);
+
+    struct arena *arena = arena_create(REQUEST_ARENA_SIZE);
+    struct filechooser_request *new_request = arena_zalloc(arena, sizeof(*new_request));
+    new_request->arena = arena;
+    new_request->type = type;
+
+    /* modal is the only option that isn't off by default */
+    switch (type) {
+    case SAVE_FILE:
+        new_request->data.save_file.modal = true;
+        break;
+    case SAVE_FILES:
+        new_request->data.save_files.modal = true;
+        break;
+    case OPEN_FILE:
+        new_request->data.open_file.modal = true;
+        break;
+    default:
+        log_print(ERROR, "UNREACHABLE: illegal request type");
+        abort();
+    }
+
+    if ((ret = options_parse(msg, options, arena, &new_request->data)) < 0 ||
+            (ret = request_data_check(new_request)) < 0) {
+        arena_destroy(arena);
+        return ret;
+    }
+
+    /* app can only restrict which files are opened, folders and saved files are up to the user */
+    const struct open_file_request_data *open_file = &new_request->data.open_file;
+    if (type == OPEN_FILE && !open_file->directory &&
+            (open_file->filters.n_filters > 0 || open_file->current_filter != NULL)) {
+        new_request->filter = filter_matcher_compile(arena, &xdptf->mime, &open_file->filters,
+                                                     open_file->current_filter);
+    }
+
+    return request_start(xdptf, new_request, msg, received, handle, app_id, parent_window, title);
+}
+
+int method_save_file(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+    return request_handle_call(data, msg, SAVE_FILE);
+}
+
+int method_save_files(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+    return request_handle_call(data, msg, SAVE_FILES);
+}
+
+int method_open_file(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+    return request_handle_call(data, msg, OPEN_FILE);
 }
 
 void filechooser_request_cleanup(struct filechooser_request *request) {
     LIST_REMOVE(request, link);
 
+    struct xdptf *xdptf = request->xdptf;
+    stats_add_request(&xdptf->stats, request->type, request->app_id, request->timestamps);
+
+    if (request->queued) {
+        TAILQ_REMOVE(&xdptf->queued_requests, request, queue_link);
+        xdptf->n_queued -= 1;
+        stats_queue_changed(&xdptf->stats, xdptf->n_queued);
+    } else if (request->started) {
+        xdptf->n_running -= 1;
+        request_schedule_dequeue(xdptf);
+    }
+
     if (request->event_loop_callback != NULL) {
         pollen_loop_remove_callback(request->event_loop_callback);
     }
 
-    if (request->slot != NULL) {
-        sd_bus_slot_unref(request->slot);
+    if (request->pidfd_callback != NULL) {
+        pollen_loop_remove_callback(request->pidfd_callback);
+    }
+
+    if (request->timeout_callback != NULL) {
+        pollen_loop_remove_callback(request->timeout_callback);
+    }
+    if (request->result_fd >= 0) {
+        close(request->result_fd);
     }
 
-    if (request->response.uris != NULL) {
-        for (int i = 0; i < request->response.n_uris; i++) {
-            free(request->response.uris[i]);
+    /* no pidfd if request is remote or picker failed to start */
+    if (request->picker_pidfd >= 0) {
+        if (request->picker_reaped) {
+            close(request->picker_pidfd);
+        } else {
+            reap_picker_later(request->xdptf->event_loop, request->picker_pidfd);
+        }
+    }
+
+    if (request->remote) {
+        LIST_REMOVE(request, remote_link);
+    }
+
+    if (request->exported) {
+        hashmap_remove(&xdptf->requests_by_handle, request->handle);
+    }
+
+    struct request_batch *batch, *batch_tmp;
+    TAILQ_FOREACH_SAFE(batch, &request->batches, link, batch_tmp) {
+        TAILQ_REMOVE(&request->batches, batch, link);
+        /* if validator thread is checking it right now, arena has to wait for it */
+        if (validator_cancel(&xdptf->validator, &batch->job)) {
+            request->n_cancelled_batches += 1;
         }
-        free(request->response.uris);
     }
 
     if (request->response.message != NULL) {
         sd_bus_message_unref(request->response.message);
     }
+    if (request->response.call != NULL) {
+        sd_bus_message_unref(request->response.call);
+    }
+    ds_free(&request->response.uri);
 
     ds_free(&request->buffer);
 
-    free(request);
+    filechooser_buffered_release(xdptf, request->n_bytes);
+
+    if (request->n_cancelled_batches > 0) {
+        return;
+    }
+    /* request itself is in the arena too */
+    arena_destroy(request->arena);
 }
 
+
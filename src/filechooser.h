@@ -1,9 +1,16 @@
 #ifndef FILECHOOSER_H
 #define FILECHOOSER_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "queue.h"
 #include "sd-bus.h"
 #include "ds.h"
+#include "stats.h"
+#include "arena.h"
+#include "options.h"
+#include "filter.h"
 
 enum filechooser_request_type {
     SAVE_FILE = 0,
@@ -11,18 +18,31 @@ enum filechooser_request_type {
     OPEN_FILE = 2,
 };
 
+/* options that apps don't provide are NULL, 0 or empty, except modal which defaults to 1 */
+
 struct save_file_request_data {
     /* suggested name of the file */
     char *current_name;
     /* suggested folder in which the file should be saved */
     char *current_folder;
+    /* file being saved over, as opposed to a new one */
+    char *current_file;
+    struct option_filter_list filters;
+    /* filter selected by default */
+    struct option_filter *current_filter;
+    struct option_choice_list choices;
+    int modal;
+    char *accept_label;
 };
 
 struct save_files_request_data {
-    /* an array of file names to be saved */
+    /* NULL-terminated array of file names to be saved */
     char **files;
     /* suggested folder in which the file should be saved */
     char *current_folder;
+    struct option_choice_list choices;
+    int modal;
+    char *accept_label;
 };
 
 struct open_file_request_data {
@@ -32,32 +52,143 @@ struct open_file_request_data {
     int directory;
     /* suggested folder in which the file should be saved */
     char *current_folder;
+    struct option_filter_list filters;
+    /* filter selected by default */
+    struct option_filter *current_filter;
+    struct option_choice_list choices;
+    int modal;
+    char *accept_label;
 };
 
 struct filechooser_request {
+    struct xdptf *xdptf;
+    /* request and everything it owns is allocated from it */
+    struct arena *arena;
+
     enum filechooser_request_type type;
-    struct sd_bus_slot *slot;
+    /* empty for host apps */
+    char *app_id;
+    char *parent_window;
+    char *title;
+    /* object path of org.freedesktop.impl.portal.Request */
+    char *handle;
+    /* in xdptf->requests_by_handle, so Close reaches it */
+    bool exported;
     struct pollen_callback *event_loop_callback;
+    struct pollen_callback *pidfd_callback;
+    /* NULL if request_timeout is not set */
+    struct pollen_callback *timeout_callback;
+
+    /* request arguments, decoded into the arena since request may outlive the method call */
+    union {
+        struct save_file_request_data save_file;
+        struct save_files_request_data save_files;
+        struct open_file_request_data open_file;
+    } data;
+    /* OpenFile: paths that don't match any of the filters are dropped. NULL if there are none */
+    struct filter_matcher *filter;
 
     struct {
+        /* method call, reply is started over from it if it has to be an error after all */
+        sd_bus_message *call;
         sd_bus_message *message;
 
+        /*
+         * uris are appended to message as soon as their paths pass the checks,
+         * message is started with the first one
+         */
+        bool started;
         int n_uris;
-        char **uris;
+        /* appending to message failed, error is sent instead */
+        bool broken;
+        /* paths that failed the checks, and ones over the limit of one path */
+        int n_dropped;
+        int n_extra;
+        /* SaveFiles: folder picker returned, uris are built from it at the end */
+        char *folder;
+        /* scratch space for encoding uris */
+        struct ds uri;
     } response;
 
+    /* number of paths picker returned so far */
+    int n_paths;
+    /* bytes of picker output taken in so far, counted against limits until cleanup */
+    size_t n_bytes;
+    /* paths waiting to be checked, see filechooser.c */
+    struct request_batch *batch;
+    TAILQ_HEAD(, request_batch) batches;
+    /* batches validator was checking when request was cleaned up, arena outlives them */
+    int n_cancelled_batches;
+    /* picker is done, response is sent once the last batch is checked */
+    bool picker_done;
+
     int pipe_fd;
+    /* memfd picker can write its result to instead of the pipe, -1 if not used */
+    int result_fd;
     pid_t picker_pid;
+    /* becomes readable when picker exits */
+    int picker_pidfd;
+    bool picker_reaped;
+    /* incomplete last path of picker output, picker output is read directly into it */
     struct ds buffer;
+    /* how much to read from pipe at once */
+    size_t read_size;
+
+    /* request is handled by picker server instead of a picker process */
+    bool remote;
+    uint32_t remote_id;
+    LIST_ENTRY(filechooser_request) remote_link;
+
+    /* picker (or picker server) got the request and counts towards picker limits */
+    bool started;
+    /* waiting for a free picker slot */
+    bool queued;
+    TAILQ_ENTRY(filechooser_request) queue_link;
+
+    /* when request reached each stage, 0 if it didn't */
+    uint64_t timestamps[STAGE_COUNT];
 
     LIST_ENTRY(filechooser_request) link;
 };
 
 int method_save_file(sd_bus_message *msg, void *data, sd_bus_error *ret_error);
 int method_open_file(sd_bus_message *msg, void *data, sd_bus_error *ret_error);
+int method_save_files(sd_bus_message *msg, void *data, sd_bus_error *ret_error);
+/* org.freedesktop.impl.portal.Request.Close, data is the request */
+int method_request_close(sd_bus_message *msg, void *data, sd_bus_error *ret_error);
 
 void filechooser_request_cleanup(struct filechooser_request *request);
+/*
+ * accounts len bytes of picker output to request, before paths are added from it.
+ * returns -ENOBUFS if request or all requests together went over output limits,
+ * request must be ended with filechooser_request_end() then.
+ */
+int filechooser_request_add_output(struct filechooser_request *request, size_t len);
+/*
+ * counts output that isn't tied to a request yet, like partly received remote frames,
+ * against max_buffered_size. returns -ENOBUFS if all requests together went over it.
+ */
+int filechooser_buffered_add(struct xdptf *xdptf, size_t len);
+void filechooser_buffered_release(struct xdptf *xdptf, size_t len);
+/*
+ * adds a single path picked by the user.
+ * returns -ENOBUFS if request went over path limit, same as above.
+ */
+int filechooser_request_add_path(struct filechooser_request *request,
+                                 const char *path, size_t len);
+/* sends response with uris added so far and cleans up the request */
 int filechooser_request_finalize(struct filechooser_request *request);
+/* sends error response and cleans up the request */
+int filechooser_request_fail(struct filechooser_request *request);
+/* stops picker, then same as filechooser_request_fail() */
+int filechooser_request_end(struct filechooser_request *request);
+/*
+ * starts local picker for a started request that picker server never got.
+ * request is failed if picker can't be started.
+ */
+int filechooser_request_start_local(struct filechooser_request *request);
+/* appends record (see record.h) describing the request to picker */
+void filechooser_request_build_record(struct filechooser_request *request, struct ds *record);
 
 #endif /* ifndef FILECHOOSER_H */
 
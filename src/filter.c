@@ -0,0 +1,293 @@
+#include <fnmatch.h>
+#include <string.h>
+
+#include "filter.h"
+#include "record.h"
+#include "log.h"
+
+/* one state more than tokens has to fit into 64 bits */
+#define GLOB_MAX_TOKENS 63
+
+/* glob pattern split into tokens, each one matches a single byte from a set */
+struct glob_program {
+    int n_tokens;
+    /* bit per byte */
+    uint64_t sets[GLOB_MAX_TOKENS][4];
+    /* bit i is set if there is a * before token i, bit n_tokens for trailing * */
+    uint64_t stars;
+};
+
+static void set_add(uint64_t set[4], unsigned char c) {
+    set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static bool set_has(const uint64_t set[4], unsigned char c) {
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+/* parses [...] at p into set, returns pointer past it, NULL if it's not terminated */
+static const char *parse_class(const char *p, uint64_t set[4]) {
+    uint64_t class[4] = {0};
+    p += 1;
+    bool negate = (*p == '!' || *p == '^');
+    if (negate) {
+        p += 1;
+    }
+
+    /* ] right after [ or [! is a literal */
+    bool first = true;
+    while (*p != '\0' && (*p != ']' || first)) {
+        /* backslash escapes inside too, same as fnmatch() */
+        if (*p == '\\' && p[1] != '\0') {
+            p += 1;
+        }
+        unsigned char low = *p;
+        unsigned char high = low;
+        p += 1;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            if (p[1] == '\\' && p[2] != '\0') {
+                p += 1;
+            }
+            high = p[1];
+            p += 2;
+        }
+        for (unsigned c = low; c <= high; c++) {
+            set_add(class, c);
+        }
+        first = false;
+    }
+    if (*p != ']') {
+        return NULL;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        set[i] = negate ? ~class[i] : class[i];
+    }
+    return p + 1;
+}
+
+/* returns false if pattern has too many tokens or uses [:class:], [.symbol.] or [=equivalence=] */
+static bool glob_parse(const char *pattern, struct glob_program *program) {
+    program->n_tokens = 0;
+    program->stars = 0;
+
+    for (const char *bracket = strchr(pattern, '['); bracket != NULL;
+            bracket = strchr(bracket + 1, '[')) {
+        if (bracket[1] == ':' || bracket[1] == '.' || bracket[1] == '=') {
+            return false;
+        }
+    }
+
+    const char *p = pattern;
+    while (*p != '\0') {
+        if (*p == '*') {
+            program->stars |= 1ULL << program->n_tokens;
+            p += 1;
+            continue;
+        }
+        if (program->n_tokens == GLOB_MAX_TOKENS) {
+            return false;
+        }
+
+        uint64_t *set = program->sets[program->n_tokens++];
+        memset(set, 0, sizeof(program->sets[0]));
+        const char *class_end;
+        if (*p == '?') {
+            memset(set, 0xFF, sizeof(program->sets[0]));
+            p += 1;
+        } else if (*p == '[' && (class_end = parse_class(p, set)) != NULL) {
+            p = class_end;
+        } else {
+            if (*p == '\\' && p[1] != '\0') {
+                p += 1;
+            }
+            set_add(set, *p);
+            p += 1;
+        }
+    }
+    return true;
+}
+
+/* puts program into states [base, base + n_tokens] of automaton */
+static void automaton_add(struct glob_automaton *automaton, int base,
+                          const struct glob_program *program) {
+    automaton->start |= 1ULL << base;
+    automaton->accept |= 1ULL << (base + program->n_tokens);
+    automaton->loop |= program->stars << base;
+
+    for (int i = 0; i < program->n_tokens; i++) {
+        uint64_t bit = 1ULL << (base + i + 1);
+        for (int c = 0; c < 256; c++) {
+            if (set_has(program->sets[i], c)) {
+                automaton->next[c] |= bit;
+            }
+        }
+    }
+}
+
+/* state of compilation that is not needed for matching */
+struct filter_compiler {
+    struct arena *arena;
+    struct mime_db *mime;
+    struct filter_matcher *matcher;
+    /* states taken in the last automaton */
+    int n_states;
+    struct glob_program program;
+};
+
+static void compile_glob(struct filter_compiler *compiler, const char *pattern) {
+    struct filter_matcher *matcher = compiler->matcher;
+
+    if (strcmp(pattern, "*") == 0) {
+        matcher->match_all = true;
+        return;
+    }
+
+    struct glob_program *program = &compiler->program;
+    if (!glob_parse(pattern, program)) {
+        matcher->fallback_globs[matcher->n_fallback_globs++] = pattern;
+        return;
+    }
+
+    /* patterns don't share states, so they can't step into each other */
+    int n_states = program->n_tokens + 1;
+    if (matcher->n_automata == 0 || compiler->n_states + n_states > 64) {
+        matcher->automata = arena_realloc(compiler->arena, matcher->automata,
+                                          matcher->n_automata * sizeof(struct glob_automaton),
+                                          (matcher->n_automata + 1) * sizeof(struct glob_automaton));
+        memset(&matcher->automata[matcher->n_automata], 0, sizeof(struct glob_automaton));
+        matcher->n_automata += 1;
+        compiler->n_states = 0;
+    }
+    automaton_add(&matcher->automata[matcher->n_automata - 1], compiler->n_states, program);
+    compiler->n_states += n_states;
+}
+
+static void compile_mime(struct filter_compiler *compiler, const char *pattern) {
+    struct filter_matcher *matcher = compiler->matcher;
+
+    mime_db_load(compiler->mime);
+    if (!mime_db_available(compiler->mime)) {
+        /* can't tell types of files, better let everything through than nothing */
+        matcher->match_all = true;
+        return;
+    }
+
+    const char *type = mime_db_unalias(compiler->mime, pattern);
+    /* every type is a subclass of it */
+    if (strcmp(type, "application/octet-stream") == 0 || strcmp(type, "*/*") == 0) {
+        matcher->match_all = true;
+        return;
+    }
+    matcher->mime_types[matcher->n_mime_types++] = type;
+}
+
+static void compile_filter(struct filter_compiler *compiler, const struct option_filter *filter) {
+    for (int i = 0; i < filter->n_rules; i++) {
+        const struct option_filter_rule *rule = &filter->rules[i];
+        switch (rule->type) {
+        case OPTION_FILTER_GLOB:
+            compile_glob(compiler, rule->pattern);
+            break;
+        case OPTION_FILTER_MIME:
+            compile_mime(compiler, rule->pattern);
+            break;
+        default:
+            log_print(WARN, "filter: %s has rule of unknown type %u, ignoring it",
+                      filter->name, rule->type);
+        }
+    }
+}
+
+struct filter_matcher *filter_matcher_compile(struct arena *arena, struct mime_db *mime,
+                                              const struct option_filter_list *filters,
+                                              const struct option_filter *current_filter) {
+    struct filter_matcher *matcher = arena_zalloc(arena, sizeof(*matcher));
+    matcher->mime = mime;
+
+    /* enough for every rule to end up in either */
+    int n_rules = (current_filter != NULL) ? current_filter->n_rules : 0;
+    for (int i = 0; i < filters->n_filters; i++) {
+        n_rules += filters->filters[i].n_rules;
+    }
+    matcher->fallback_globs = arena_alloc(arena, n_rules * sizeof(char *));
+    matcher->mime_types = arena_alloc(arena, n_rules * sizeof(char *));
+
+    struct filter_compiler compiler = {
+        .arena = arena,
+        .mime = mime,
+        .matcher = matcher,
+    };
+    for (int i = 0; i < filters->n_filters; i++) {
+        compile_filter(&compiler, &filters->filters[i]);
+    }
+    if (current_filter != NULL) {
+        compile_filter(&compiler, current_filter);
+    }
+
+    log_print(DEBUG, "filter: compiled %d rules into %d automata, %d fallback globs and %d mime types%s",
+              n_rules, matcher->n_automata, matcher->n_fallback_globs, matcher->n_mime_types,
+              matcher->match_all ? ", matches everything" : "");
+    return matcher;
+}
+
+static bool automaton_match(const struct glob_automaton *automaton,
+                            const unsigned char *name, size_t len) {
+    uint64_t state = automaton->start;
+    for (size_t i = 0; i < len && state != 0; i++) {
+        state = ((state << 1) & automaton->next[name[i]]) | (state & automaton->loop);
+    }
+    return (state & automaton->accept) != 0;
+}
+
+bool filter_matcher_match(const struct filter_matcher *matcher, const char *name, size_t len) {
+    if (matcher->match_all) {
+        return true;
+    }
+
+    for (int i = 0; i < matcher->n_automata; i++) {
+        if (automaton_match(&matcher->automata[i], (const unsigned char *)name, len)) {
+            return true;
+        }
+    }
+
+    for (int i = 0; i < matcher->n_fallback_globs; i++) {
+        if (fnmatch(matcher->fallback_globs[i], name, 0) == 0) {
+            return true;
+        }
+    }
+
+    if (matcher->n_mime_types > 0) {
+        const char *type = mime_db_lookup(matcher->mime, name, len);
+        if (type == NULL) {
+            return false;
+        }
+        for (int i = 0; i < matcher->n_mime_types; i++) {
+            if (mime_type_is_a(matcher->mime, type, matcher->mime_types[i])) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void filter_add_to_record(struct ds *record, struct mime_db *mime,
+                          const struct option_filter *filter) {
+    record_add(record, "filter", filter->name);
+
+    for (int i = 0; i < filter->n_rules; i++) {
+        const struct option_filter_rule *rule = &filter->rules[i];
+        if (rule->type == OPTION_FILTER_GLOB) {
+            record_add(record, "glob", rule->pattern);
+        } else if (rule->type == OPTION_FILTER_MIME) {
+            mime_db_load(mime);
+            const char *type = mime_db_unalias(mime, rule->pattern);
+            for (int j = 0; j < mime->n_globs; j++) {
+                if (mime_type_is_a(mime, mime->globs[j].type, type)) {
+                    record_add(record, "glob", mime->globs[j].glob);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "options.h"
+#include "mime.h"
+#include "arena.h"
+#include "ds.h"
+
+/*
+ * Filters of FileChooser requests compiled for matching file names.
+ * Glob rules of all filters are turned into bit-parallel automata: every
+ * pattern gets a bit per position and the bits of several patterns are
+ * packed into one 64-bit word, so a name is matched against all of them
+ * with a table lookup, a shift and two masks per byte. MIME rules are
+ * matched against the type that the mime database gives to the name.
+ *
+ * Globs are byte-wise: ? and [...] match a single byte, not a character.
+ */
+
+struct glob_automaton {
+    /* bit of every state that a byte can move into from the previous one */
+    uint64_t next[256];
+    /* start state of every pattern */
+    uint64_t start;
+    /* states after a *, they stay active on any byte */
+    uint64_t loop;
+    /* final state of every pattern */
+    uint64_t accept;
+};
+
+struct filter_matcher {
+    /* some rule matches everything, like * glob or application/octet-stream */
+    bool match_all;
+    struct glob_automaton *automata;
+    int n_automata;
+    /* patterns that automata can't run, matched with fnmatch() */
+    const char **fallback_globs;
+    int n_fallback_globs;
+    /* without aliases, can be whole media types like image followed by slash and star */
+    const char **mime_types;
+    int n_mime_types;
+    const struct mime_db *mime;
+};
+
+/*
+ * compiles union of filters and current_filter (which can be NULL) into a
+ * matcher allocated from arena. loads mime database if there are MIME rules.
+ */
+struct filter_matcher *filter_matcher_compile(struct arena *arena, struct mime_db *mime,
+                                              const struct option_filter_list *filters,
+                                              const struct option_filter *current_filter);
+/* whether NUL-terminated file name (without directory) of len bytes matches any of the filters */
+bool filter_matcher_match(const struct filter_matcher *matcher, const char *name, size_t len);
+
+/*
+ * appends filter=name and a glob=... pair for every glob of filter to record.
+ * MIME rules are expanded into globs of their types, so pickers only have to
+ * deal with globs.
+ */
+void filter_add_to_record(struct ds *record, struct mime_db *mime,
+                          const struct option_filter *filter);
+
+#endif /* #ifndef FILTER_H */
@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "hashmap.h"
+#include "xmalloc.h"
+
+#define HASHMAP_MIN_CAPACITY 16
+
+/* FNV-1a */
+static uint64_t hash_string(const char *str) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/* returns slot of key, or empty slot where it would go */
+static size_t hashmap_find_slot(const struct hashmap *map, const char *key, uint64_t hash) {
+    size_t mask = map->capacity - 1;
+    size_t i = hash & mask;
+    while (true) {
+        const struct hashmap_entry *entry = &map->entries[i];
+        if (entry->key == NULL ||
+                (entry->hash == hash && strcmp(entry->key, key) == 0)) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static void hashmap_resize(struct hashmap *map, size_t capacity) {
+    struct hashmap_entry *old_entries = map->entries;
+    size_t old_capacity = map->capacity;
+
+    map->entries = xcalloc(capacity, sizeof(*map->entries));
+    map->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].key != NULL) {
+            size_t slot = hashmap_find_slot(map, old_entries[i].key, old_entries[i].hash);
+            map->entries[slot] = old_entries[i];
+        }
+    }
+
+    free(old_entries);
+}
+
+void hashmap_init(struct hashmap *map) {
+    map->capacity = 0;
+    map->n_entries = 0;
+    map->entries = NULL;
+}
+
+void hashmap_free(struct hashmap *map) {
+    free(map->entries);
+    hashmap_init(map);
+}
+
+int hashmap_insert(struct hashmap *map, const char *key, void *value) {
+    /* keep load factor under 3/4 */
+    if ((map->n_entries + 1) * 4 > map->capacity * 3) {
+        hashmap_resize(map, (map->capacity == 0) ? HASHMAP_MIN_CAPACITY : map->capacity * 2);
+    }
+
+    uint64_t hash = hash_string(key);
+    size_t slot = hashmap_find_slot(map, key, hash);
+    struct hashmap_entry *entry = &map->entries[slot];
+    if (entry->key != NULL) {
+        return -EEXIST;
+    }
+
+    entry->key = key;
+    entry->hash = hash;
+    entry->value = value;
+    map->n_entries += 1;
+
+    return 0;
+}
+
+void *hashmap_get(const struct hashmap *map, const char *key) {
+    if (map->n_entries == 0) {
+        return NULL;
+    }
+
+    size_t slot = hashmap_find_slot(map, key, hash_string(key));
+    return map->entries[slot].value;
+}
+
+void *hashmap_remove(struct hashmap *map, const char *key) {
+    if (map->n_entries == 0) {
+        return NULL;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t slot = hashmap_find_slot(map, key, hash_string(key));
+    if (map->entries[slot].key == NULL) {
+        return NULL;
+    }
+    void *value = map->entries[slot].value;
+    map->n_entries -= 1;
+
+    /*
+     * move back every following entry that would become unreachable
+     * through the hole, i.e. whose home slot is not between hole and it
+     */
+    size_t hole = slot;
+    size_t i = slot;
+    while (true) {
+        i = (i + 1) & mask;
+        struct hashmap_entry *entry = &map->entries[i];
+        if (entry->key == NULL) {
+            break;
+        }
+        size_t home = entry->hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->entries[hole] = *entry;
+            hole = i;
+        }
+    }
+    map->entries[hole].key = NULL;
+    map->entries[hole].value = NULL;
+
+    return value;
+}
@@ -0,0 +1,39 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hash map from strings to pointers. Open addressing with linear probing,
+ * removal shifts the entries that follow back instead of leaving tombstones,
+ * so lookups never get slower as entries come and go.
+ * Keys are not copied, they must stay valid for as long as they are in the map.
+ * Zeroed hashmap is a valid empty one.
+ */
+
+struct hashmap_entry {
+    /* NULL if slot is empty */
+    const char *key;
+    uint64_t hash;
+    void *value;
+};
+
+struct hashmap {
+    /* power of two, or 0 if nothing was inserted yet */
+    size_t capacity;
+    size_t n_entries;
+    struct hashmap_entry *entries;
+};
+
+void hashmap_init(struct hashmap *map);
+void hashmap_free(struct hashmap *map);
+
+/* returns 0 on success, -EEXIST if key is already in the map */
+int hashmap_insert(struct hashmap *map, const char *key, void *value);
+/* returns NULL if key is not in the map */
+void *hashmap_get(const struct hashmap *map, const char *key);
+/* returns value that was removed, NULL if key was not in the map */
+void *hashmap_remove(struct hashmap *map, const char *key);
+
+#endif /* #ifndef HASHMAP_H */
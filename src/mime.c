@@ -0,0 +1,252 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mime.h"
+#include "log.h"
+#include "xmalloc.h"
+
+#define MIME_ARENA_SIZE (64 * 1024)
+/* subclass chains in real databases are a few types long, this only stops loops */
+#define MIME_MAX_DEPTH 16
+
+struct mime_parent {
+    const char *type;
+    struct mime_parent *next;
+};
+
+/* whether glob has no wildcards */
+static bool is_plain(const char *glob) {
+    return strpbrk(glob, "*?[") == NULL;
+}
+
+static void lowercase(char *str) {
+    for (; *str != '\0'; str++) {
+        if (*str >= 'A' && *str <= 'Z') {
+            *str += 'a' - 'A';
+        }
+    }
+}
+
+static void add_glob(struct mime_db *db, const char *type, const char *glob) {
+    /* capacity doubles from 64, implied by n_globs */
+    int n = db->n_globs;
+    if (n == 0 || (n >= 64 && (n & (n - 1)) == 0)) {
+        db->globs = xrealloc(db->globs, ((n == 0) ? 64 : 2 * n) * sizeof(*db->globs));
+    }
+    db->globs[n].type = type;
+    db->globs[n].glob = glob;
+    db->n_globs += 1;
+
+    /* globs are lowercase already, except the case-sensitive ones which are rare */
+    char *key = arena_strdup(db->arena, glob);
+    lowercase(key);
+    /* first one wins, globs2 is sorted by weight and data dirs are loaded in order of priority */
+    if (key[0] == '*' && key[1] == '.' && is_plain(key + 2)) {
+        hashmap_insert(&db->by_suffix, key + 2, (void *)type);
+    } else if (is_plain(key)) {
+        hashmap_insert(&db->by_name, key, (void *)type);
+    }
+}
+
+static void add_alias(struct mime_db *db, const char *alias, const char *type) {
+    hashmap_insert(&db->aliases, alias, (void *)type);
+}
+
+static void add_parent(struct mime_db *db, const char *type, const char *parent) {
+    struct mime_parent *entry = arena_alloc(db->arena, sizeof(*entry));
+    entry->type = parent;
+    /* types can have several parents, map holds the latest one */
+    entry->next = hashmap_remove(&db->parents, type);
+    hashmap_insert(&db->parents, type, entry);
+}
+
+/* globs2 has weight:type:glob[:flags] lines */
+static void load_globs(struct mime_db *db, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+
+    char *line = NULL;
+    size_t buf_size = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &buf_size, f)) > 0) {
+        if (line[0] == '#') {
+            continue;
+        }
+        if (line[line_len - 1] == '\n') {
+            line[line_len - 1] = '\0';
+        }
+
+        char *type = strchr(line, ':');
+        char *glob = (type != NULL) ? strchr(type + 1, ':') : NULL;
+        if (glob == NULL) {
+            continue;
+        }
+        *type++ = '\0';
+        *glob++ = '\0';
+        char *flags = strchr(glob, ':');
+        if (flags != NULL) {
+            *flags = '\0';
+        }
+
+        add_glob(db, arena_strdup(db->arena, type), arena_strdup(db->arena, glob));
+    }
+
+    free(line);
+    fclose(f);
+}
+
+/* aliases and subclasses have "type other" lines */
+static void load_pairs(struct mime_db *db, const char *path,
+                       void (*add)(struct mime_db *db, const char *type, const char *other)) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return;
+    }
+
+    char *line = NULL;
+    size_t buf_size = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &buf_size, f)) > 0) {
+        if (line[line_len - 1] == '\n') {
+            line[line_len - 1] = '\0';
+        }
+        char *other = strchr(line, ' ');
+        if (other == NULL) {
+            continue;
+        }
+        *other++ = '\0';
+        add(db, arena_strdup(db->arena, line), arena_strdup(db->arena, other));
+    }
+
+    free(line);
+    fclose(f);
+}
+
+static void load_data_dir(struct mime_db *db, const char *dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mime/globs2", dir);
+    load_globs(db, path);
+    snprintf(path, sizeof(path), "%s/mime/aliases", dir);
+    load_pairs(db, path, add_alias);
+    snprintf(path, sizeof(path), "%s/mime/subclasses", dir);
+    load_pairs(db, path, add_parent);
+}
+
+void mime_db_load(struct mime_db *db) {
+    if (db->loaded) {
+        return;
+    }
+    db->loaded = true;
+    db->arena = arena_create(MIME_ARENA_SIZE);
+
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    if (data_home != NULL && data_home[0] != '\0') {
+        load_data_dir(db, data_home);
+    } else if (home != NULL) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/.local/share", home);
+        load_data_dir(db, dir);
+    }
+
+    const char *data_dirs = getenv("XDG_DATA_DIRS");
+    if (data_dirs == NULL || data_dirs[0] == '\0') {
+        data_dirs = "/usr/local/share:/usr/share";
+    }
+    char *dirs = xstrdup(data_dirs);
+    char *saveptr = NULL;
+    for (char *dir = strtok_r(dirs, ":", &saveptr); dir != NULL;
+            dir = strtok_r(NULL, ":", &saveptr)) {
+        load_data_dir(db, dir);
+    }
+    free(dirs);
+
+    if (mime_db_available(db)) {
+        log_print(DEBUG, "mime: loaded %d globs and %zu subclasses", db->n_globs,
+                  db->parents.n_entries);
+    } else {
+        log_print(WARN, "mime: no shared-mime-info database found, types of files are unknown");
+    }
+}
+
+void mime_db_cleanup(struct mime_db *db) {
+    hashmap_free(&db->by_suffix);
+    hashmap_free(&db->by_name);
+    hashmap_free(&db->aliases);
+    hashmap_free(&db->parents);
+    free(db->globs);
+    if (db->arena != NULL) {
+        arena_destroy(db->arena);
+    }
+}
+
+bool mime_db_available(const struct mime_db *db) {
+    return db->n_globs > 0;
+}
+
+const char *mime_db_lookup(const struct mime_db *db, const char *name, size_t len) {
+    char key[NAME_MAX + 1];
+    if (len == 0 || len > NAME_MAX) {
+        return NULL;
+    }
+    memcpy(key, name, len);
+    key[len] = '\0';
+    lowercase(key);
+
+    const char *type = hashmap_get(&db->by_name, key);
+    if (type != NULL) {
+        return type;
+    }
+
+    /* longest suffix first, so "tar.gz" wins over "gz" */
+    for (char *dot = strchr(key, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+        type = hashmap_get(&db->by_suffix, dot + 1);
+        if (type != NULL) {
+            return type;
+        }
+    }
+    return NULL;
+}
+
+const char *mime_db_unalias(const struct mime_db *db, const char *type) {
+    const char *unaliased = hashmap_get(&db->aliases, type);
+    return (unaliased != NULL) ? unaliased : type;
+}
+
+static bool type_matches(const char *type, const char *pattern) {
+    size_t len = strlen(pattern);
+    if (len >= 2 && pattern[len - 2] == '/' && pattern[len - 1] == '*') {
+        return strncmp(type, pattern, len - 1) == 0;
+    }
+    return strcmp(type, pattern) == 0;
+}
+
+static bool type_is_a(const struct mime_db *db, const char *type, const char *pattern, int depth) {
+    if (type_matches(type, pattern)) {
+        return true;
+    }
+    /* same as in glib, every text type is plain text too */
+    if (strncmp(type, "text/", strlen("text/")) == 0 && strcmp(pattern, "text/plain") == 0) {
+        return true;
+    }
+    if (depth == MIME_MAX_DEPTH) {
+        return false;
+    }
+
+    for (const struct mime_parent *parent = hashmap_get(&db->parents, type);
+            parent != NULL; parent = parent->next) {
+        if (type_is_a(db, parent->type, pattern, depth + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool mime_type_is_a(const struct mime_db *db, const char *type, const char *pattern) {
+    return type_is_a(db, type, pattern, 0);
+}
@@ -0,0 +1,57 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "hashmap.h"
+
+/*
+ * Types of files by their names, from shared-mime-info database (globs2,
+ * subclasses and aliases in mime/ of XDG data dirs). Contents of files are
+ * never looked at, so files whose names don't tell their type have none.
+ * Only plain globs are used for lookups: "*.ext" and literal file names,
+ * which is almost all of them. The rest are only listed in globs.
+ */
+
+struct mime_glob {
+    const char *type;
+    const char *glob;
+};
+
+struct mime_db {
+    /* database was looked for already, see mime_db_load() */
+    bool loaded;
+    /* everything below is allocated from it */
+    struct arena *arena;
+
+    /* lowercase part of name after a dot, e.g. "tar.gz" -> type */
+    struct hashmap by_suffix;
+    /* lowercase file name -> type */
+    struct hashmap by_name;
+    /* alias -> type */
+    struct hashmap aliases;
+    /* type -> struct mime_parent list */
+    struct hashmap parents;
+
+    /* every glob of database, in the order of priority */
+    struct mime_glob *globs;
+    int n_globs;
+};
+
+/* loads database the first time it's called. zeroed mime_db is valid to call it on */
+void mime_db_load(struct mime_db *db);
+void mime_db_cleanup(struct mime_db *db);
+
+/* false if no database was found, types of files can't be told then */
+bool mime_db_available(const struct mime_db *db);
+
+/* returns type of file with name (without directory), NULL if it's unknown */
+const char *mime_db_lookup(const struct mime_db *db, const char *name, size_t len);
+/* returns type that alias stands for, or type itself if it's not an alias */
+const char *mime_db_unalias(const struct mime_db *db, const char *type);
+/* whether type is pattern or its subclass. pattern may use * as subtype to match a whole media type */
+bool mime_type_is_a(const struct mime_db *db, const char *type, const char *pattern);
+
+#endif /* #ifndef MIME_H */
@@ -0,0 +1,353 @@
+#include <string.h>
+#include <errno.h>
+
+#include "options.h"
+#include "log.h"
+
+/*
+ * Perfect hash of option names, in the style of gperf: hash is length of the
+ * key plus associated values of its first and third to last characters. The
+ * values were picked by a small search so that no two option names collide,
+ * and the range of hashes is dense enough to index option_words directly.
+ * Adding an option means picking them again, check option_words afterwards.
+ */
+#define OPTION_MIN_LENGTH 5
+#define OPTION_MAX_LENGTH 14
+#define OPTION_MIN_HASH 7
+#define OPTION_MAX_HASH 19
+
+/* for 'a' to 'z', characters that don't occur in option names push hash out of range */
+static const unsigned char option_asso_values[26] = {
+    0, 7, 0, 1, 9, 0, 20, 20, 1, 20, 20, 9, 2,
+    20, 1, 7, 20, 20, 20, 4, 20, 20, 20, 20, 20, 20,
+};
+
+struct option_word {
+    const char *name;
+    int id;
+};
+
+static const struct option_word option_words[OPTION_MAX_HASH - OPTION_MIN_HASH + 1] = {
+    [7 - OPTION_MIN_HASH] = { "choices", OPTION_CHOICES },
+    [8 - OPTION_MIN_HASH] = { "modal", OPTION_MODAL },
+    [11 - OPTION_MIN_HASH] = { "directory", OPTION_DIRECTORY },
+    [12 - OPTION_MIN_HASH] = { "current_name", OPTION_CURRENT_NAME },
+    [13 - OPTION_MIN_HASH] = { "current_file", OPTION_CURRENT_FILE },
+    [14 - OPTION_MIN_HASH] = { "files", OPTION_FILES },
+    [15 - OPTION_MIN_HASH] = { "current_folder", OPTION_CURRENT_FOLDER },
+    [16 - OPTION_MIN_HASH] = { "filters", OPTION_FILTERS },
+    [17 - OPTION_MIN_HASH] = { "multiple", OPTION_MULTIPLE },
+    [18 - OPTION_MIN_HASH] = { "current_filter", OPTION_CURRENT_FILTER },
+    [19 - OPTION_MIN_HASH] = { "accept_label", OPTION_ACCEPT_LABEL },
+};
+
+static inline unsigned option_asso_value(unsigned char c) {
+    return (c >= 'a' && c <= 'z') ? option_asso_values[c - 'a'] : OPTION_MAX_HASH + 1;
+}
+
+int option_lookup(const char *key, size_t len) {
+    if (len < OPTION_MIN_LENGTH || len > OPTION_MAX_LENGTH) {
+        return -1;
+    }
+
+    unsigned hash = len + option_asso_value(key[0]) + option_asso_value(key[len - 3]);
+    if (hash < OPTION_MIN_HASH || hash > OPTION_MAX_HASH) {
+        return -1;
+    }
+
+    const struct option_word *word = &option_words[hash - OPTION_MIN_HASH];
+    if (word->name == NULL || strcmp(word->name, key) != 0) {
+        return -1;
+    }
+    return word->id;
+}
+
+/*
+ * makes room for one more element in array of n elements. arrays are decoded
+ * without knowing their length up front, so capacity doubles from 4, and it
+ * is implied by n so it doesn't have to be stored anywhere.
+ */
+static void *array_grow(struct arena *arena, void *array, int n, size_t size) {
+    if (n == 0) {
+        return arena_alloc(arena, 4 * size);
+    }
+    if (n < 4 || (n & (n - 1)) != 0) {
+        return array;
+    }
+    return arena_realloc(arena, array, n * size, 2 * n * size);
+}
+
+int option_decode_string(sd_bus_message *msg, struct arena *arena, void *dst) {
+    const char *value;
+    int ret = sd_bus_message_read(msg, "s", &value);
+    if (ret < 0) {
+        return ret;
+    }
+    *(char **)dst = arena_strdup(arena, value);
+    return 0;
+}
+
+int option_decode_bool(sd_bus_message *msg, struct arena *arena, void *dst) {
+    int value;
+    int ret = sd_bus_message_read(msg, "b", &value);
+    if (ret < 0) {
+        return ret;
+    }
+    *(int *)dst = value;
+    return 0;
+}
+
+/* returns 0 at the end of array */
+static int read_bytestring(sd_bus_message *msg, struct arena *arena, char **dst) {
+    const void *ptr;
+    size_t size;
+    int ret = sd_bus_message_read_array(msg, 'y', &ptr, &size);
+    if (ret <= 0) {
+        return ret;
+    }
+    /* bytestrings are NUL-terminated, don't trust it blindly */
+    if (size == 0 || memchr(ptr, '\0', size) != (const char *)ptr + size - 1) {
+        log_print(ERROR, "options: bytestring is not NUL-terminated");
+        return -EINVAL;
+    }
+    *dst = arena_strndup(arena, ptr, size - 1);
+    return 1;
+}
+
+int option_decode_bytestring(sd_bus_message *msg, struct arena *arena, void *dst) {
+    int ret = read_bytestring(msg, arena, dst);
+    /* end of array is impossible outside of an array, but still */
+    return (ret == 0) ? -EINVAL : (ret < 0) ? ret : 0;
+}
+
+int option_decode_bytestrings(sd_bus_message *msg, struct arena *arena, void *dst) {
+    int ret = 0;
+    char **strings = NULL;
+    int n = 0;
+
+    if ((ret = sd_bus_message_enter_container(msg, 'a', "ay")) < 0) {
+        return ret;
+    }
+    for (;;) {
+        /* slot for next string, or for NULL terminator after the last one */
+        strings = array_grow(arena, strings, n, sizeof(char *));
+        if ((ret = read_bytestring(msg, arena, &strings[n])) <= 0) {
+            break;
+        }
+        n += 1;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    strings[n] = NULL;
+    *(char ***)dst = strings;
+
+    return sd_bus_message_exit_container(msg);
+}
+
+/* reads (sa(us)) struct, the current position must be at it. returns 0 at the end of array */
+static int read_filter(sd_bus_message *msg, struct arena *arena, struct option_filter *filter) {
+    int ret = 0;
+    const char *name;
+
+    if ((ret = sd_bus_message_enter_container(msg, 'r', "sa(us)")) <= 0) {
+        return ret;
+    }
+    if ((ret = sd_bus_message_read(msg, "s", &name)) < 0 ||
+            (ret = sd_bus_message_enter_container(msg, 'a', "(us)")) < 0) {
+        return ret;
+    }
+    filter->name = arena_strdup(arena, name);
+    filter->rules = NULL;
+    filter->n_rules = 0;
+
+    for (;;) {
+        uint32_t type;
+        const char *pattern;
+        if ((ret = sd_bus_message_read(msg, "(us)", &type, &pattern)) <= 0) {
+            break;
+        }
+        filter->rules = array_grow(arena, filter->rules, filter->n_rules,
+                                   sizeof(struct option_filter_rule));
+        filter->rules[filter->n_rules].type = type;
+        filter->rules[filter->n_rules].pattern = arena_strdup(arena, pattern);
+        filter->n_rules += 1;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* array and struct */
+    if ((ret = sd_bus_message_exit_container(msg)) < 0 ||
+            (ret = sd_bus_message_exit_container(msg)) < 0) {
+        return ret;
+    }
+    return 1;
+}
+
+int option_decode_filters(sd_bus_message *msg, struct arena *arena, void *dst) {
+    int ret = 0;
+    struct option_filter_list *list = dst;
+    list->filters = NULL;
+    list->n_filters = 0;
+
+    if ((ret = sd_bus_message_enter_container(msg, 'a', "(sa(us))")) < 0) {
+        return ret;
+    }
+    for (;;) {
+        list->filters = array_grow(arena, list->filters, list->n_filters,
+                                   sizeof(struct option_filter));
+        if ((ret = read_filter(msg, arena, &list->filters[list->n_filters])) <= 0) {
+            break;
+        }
+        list->n_filters += 1;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    return sd_bus_message_exit_container(msg);
+}
+
+int option_decode_filter(sd_bus_message *msg, struct arena *arena, void *dst) {
+    struct option_filter *filter = arena_alloc(arena, sizeof(*filter));
+    int ret = read_filter(msg, arena, filter);
+    if (ret <= 0) {
+        return (ret == 0) ? -EINVAL : ret;
+    }
+    *(struct option_filter **)dst = filter;
+    return 0;
+}
+
+/* reads (ssa(ss)s) struct. returns 0 at the end of array */
+static int read_choice(sd_bus_message *msg, struct arena *arena, struct option_choice *choice) {
+    int ret = 0;
+    const char *id, *label, *initial;
+
+    if ((ret = sd_bus_message_enter_container(msg, 'r', "ssa(ss)s")) <= 0) {
+        return ret;
+    }
+    if ((ret = sd_bus_message_read(msg, "ss", &id, &label)) < 0 ||
+            (ret = sd_bus_message_enter_container(msg, 'a', "(ss)")) < 0) {
+        return ret;
+    }
+    choice->id = arena_strdup(arena, id);
+    choice->label = arena_strdup(arena, label);
+    choice->options = NULL;
+    choice->n_options = 0;
+
+    for (;;) {
+        const char *option_id, *option_label;
+        if ((ret = sd_bus_message_read(msg, "(ss)", &option_id, &option_label)) <= 0) {
+            break;
+        }
+        choice->options = array_grow(arena, choice->options, choice->n_options,
+                                     sizeof(struct option_choice_option));
+        choice->options[choice->n_options].id = arena_strdup(arena, option_id);
+        choice->options[choice->n_options].label = arena_strdup(arena, option_label);
+        choice->n_options += 1;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if ((ret = sd_bus_message_exit_container(msg)) < 0 ||
+            (ret = sd_bus_message_read(msg, "s", &initial)) < 0 ||
+            (ret = sd_bus_message_exit_container(msg)) < 0) {
+        return ret;
+    }
+    choice->initial = arena_strdup(arena, initial);
+    return 1;
+}
+
+int option_decode_choices(sd_bus_message *msg, struct arena *arena, void *dst) {
+    int ret = 0;
+    struct option_choice_list *list = dst;
+    list->choices = NULL;
+    list->n_choices = 0;
+
+    if ((ret = sd_bus_message_enter_container(msg, 'a', "(ssa(ss)s)")) < 0) {
+        return ret;
+    }
+    for (;;) {
+        list->choices = array_grow(arena, list->choices, list->n_choices,
+                                   sizeof(struct option_choice));
+        if ((ret = read_choice(msg, arena, &list->choices[list->n_choices])) <= 0) {
+            break;
+        }
+        list->n_choices += 1;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    return sd_bus_message_exit_container(msg);
+}
+
+/* key and value are read, dict entry is entered */
+static int parse_option(sd_bus_message *msg, const struct option_table *table,
+                        struct arena *arena, void *data) {
+    int ret = 0;
+    const char *key;
+
+    if ((ret = sd_bus_message_read(msg, "s", &key)) < 0) {
+        log_print(ERROR, "%s: sd_bus_message_read() failed", table->method);
+        return ret;
+    }
+
+    int id = option_lookup(key, strlen(key));
+    const struct option_spec *spec = (id >= 0) ? &table->options[id] : NULL;
+    if (spec == NULL || spec->decode == NULL) {
+        log_print(DEBUG, "%s: option %s IGNORED", table->method, key);
+        return sd_bus_message_skip(msg, "v");
+    }
+
+    const char *contents;
+    if ((ret = sd_bus_message_peek_type(msg, NULL, &contents)) < 0) {
+        log_print(ERROR, "%s: sd_bus_message_peek_type() failed", table->method);
+        return ret;
+    }
+    if (strcmp(contents, spec->signature) != 0) {
+        log_print(WARN, "%s: option %s has type %s instead of %s, ignoring it",
+                  table->method, key, contents, spec->signature);
+        return sd_bus_message_skip(msg, "v");
+    }
+
+    if ((ret = sd_bus_message_enter_container(msg, 'v', contents)) < 0) {
+        log_print(ERROR, "%s: sd_bus_message_enter_container() failed", table->method);
+        return ret;
+    }
+    if ((ret = spec->decode(msg, arena, (char *)data + spec->offset)) < 0) {
+        log_print(ERROR, "%s: failed to decode option %s: %s",
+                  table->method, key, strerror(-ret));
+        return ret;
+    }
+    log_print(DEBUG, "%s: option %s", table->method, key);
+
+    return sd_bus_message_exit_container(msg);
+}
+
+int options_parse(sd_bus_message *msg, const struct option_table *table,
+                  struct arena *arena, void *data) {
+    int ret = 0;
+
+    if ((ret = sd_bus_message_enter_container(msg, 'a', "{sv}")) < 0) {
+        log_print(ERROR, "%s: sd_bus_message_enter_container() failed", table->method);
+        return ret;
+    }
+    while ((ret = sd_bus_message_enter_container(msg, 'e', "sv")) > 0) {
+        if ((ret = parse_option(msg, table, arena, data)) < 0) {
+            return ret;
+        }
+        if ((ret = sd_bus_message_exit_container(msg)) < 0) {
+            log_print(ERROR, "%s: sd_bus_message_exit_container() failed", table->method);
+            return ret;
+        }
+    }
+    if (ret < 0) {
+        log_print(ERROR, "%s: sd_bus_message_enter_container() failed", table->method);
+        return ret;
+    }
+
+    return sd_bus_message_exit_container(msg);
+}
@@ -0,0 +1,123 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sd-bus.h"
+#include "arena.h"
+
+/*
+ * Decoding of a{sv} options of FileChooser methods. Every method has a table
+ * indexed by option id that says which options it takes, what type they must
+ * have and where in its request data they go. Option names are looked up with
+ * a perfect hash, so each key costs one hash and one strcmp, and every option
+ * is decoded straight into the arena in a single pass over the message.
+ */
+
+enum option_id {
+    OPTION_ACCEPT_LABEL,
+    OPTION_MODAL,
+    OPTION_MULTIPLE,
+    OPTION_DIRECTORY,
+    OPTION_FILTERS,
+    OPTION_CURRENT_FILTER,
+    OPTION_CHOICES,
+    OPTION_CURRENT_NAME,
+    OPTION_CURRENT_FOLDER,
+    OPTION_CURRENT_FILE,
+    OPTION_FILES,
+    OPTION_COUNT,
+};
+
+enum option_filter_rule_type {
+    OPTION_FILTER_GLOB = 0,
+    OPTION_FILTER_MIME = 1,
+};
+
+struct option_filter_rule {
+    /* enum option_filter_rule_type, anything else is kept but never matches */
+    uint32_t type;
+    char *pattern;
+};
+
+/* (sa(us)) */
+struct option_filter {
+    char *name;
+    struct option_filter_rule *rules;
+    int n_rules;
+};
+
+/* a(sa(us)), n_filters is 0 if app didn't provide any */
+struct option_filter_list {
+    struct option_filter *filters;
+    int n_filters;
+};
+
+struct option_choice_option {
+    char *id;
+    char *label;
+};
+
+/* (ssa(ss)s), options are empty for boolean choices */
+struct option_choice {
+    char *id;
+    char *label;
+    struct option_choice_option *options;
+    int n_options;
+    char *initial;
+};
+
+/* a(ssa(ss)s) */
+struct option_choice_list {
+    struct option_choice *choices;
+    int n_choices;
+};
+
+/* decodes value of the variant into dst, allocating from arena. returns negative errno on failure */
+typedef int (*option_decode_fn)(sd_bus_message *msg, struct arena *arena, void *dst);
+
+struct option_spec {
+    /* signature of the value inside the variant, options of other types are ignored */
+    const char *signature;
+    /* offset of the field in request data */
+    size_t offset;
+    /* NULL if method doesn't take the option */
+    option_decode_fn decode;
+};
+
+struct option_table {
+    /* for logging */
+    const char *method;
+    struct option_spec options[OPTION_COUNT];
+};
+
+/* returns option id of key, -1 if it's not an option of any method */
+int option_lookup(const char *key, size_t len);
+
+/*
+ * reads a{sv} options from msg into data as described by table. unknown
+ * options and options with wrong types are skipped. fields of options that
+ * are missing are left untouched, so defaults must be set before.
+ * returns negative errno on failure.
+ */
+int options_parse(sd_bus_message *msg, const struct option_table *table,
+                  struct arena *arena, void *data);
+
+/* decoders, dst points to a field of the type in the comment */
+/* s, char * */
+int option_decode_string(sd_bus_message *msg, struct arena *arena, void *dst);
+/* b, int */
+int option_decode_bool(sd_bus_message *msg, struct arena *arena, void *dst);
+/* ay, char *. bytestring must be NUL-terminated and contain no other NULs */
+int option_decode_bytestring(sd_bus_message *msg, struct arena *arena, void *dst);
+/* aay, char **, NULL-terminated */
+int option_decode_bytestrings(sd_bus_message *msg, struct arena *arena, void *dst);
+/* a(sa(us)), struct option_filter_list */
+int option_decode_filters(sd_bus_message *msg, struct arena *arena, void *dst);
+/* (sa(us)), struct option_filter * */
+int option_decode_filter(sd_bus_message *msg, struct arena *arena, void *dst);
+/* a(ssa(ss)s), struct option_choice_list */
+int option_decode_choices(sd_bus_message *msg, struct arena *arena, void *dst);
+
+#endif /* #ifndef OPTIONS_H */
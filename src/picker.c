@@ -1,136 +1,465 @@
+#define _GNU_SOURCE /* pipe2(), SOCK_CLOEXEC, memfd_create() */
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "picker.h"
 #include "filechooser.h"
+#include "spawner.h"
 #include "log.h"
+#include "xmalloc.h"
+
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
 
 enum {
     PIPE_READING_END = 0,
     PIPE_WRITING_END = 1,
 };
 
-int exec_picker(const char *exe,
-                enum filechooser_request_type request_type, void *request_data, pid_t *child_pid) {
+int picker_get_args(enum filechooser_request_type request_type, void *request_data,
+                    const char *args[static PICKER_MAX_ARGS + 1]) {
+    switch (request_type) {
+    case SAVE_FILE: {
+        struct save_file_request_data *data = request_data;
+        const char *current_name = data->current_name;
+        const char *current_folder = data->current_folder;
+
+        args[0] = "0"; /* SAVE_FILE */
+        args[1] = (current_folder != NULL) ? current_folder : "/tmp";
+        args[2] = (current_name != NULL) ? current_name : "FALLBACK_FILENAME";
+        args[3] = NULL;
+        return 3;
+    }
+    case OPEN_FILE: {
+        struct open_file_request_data *data = request_data;
+        const char *current_folder = data->current_folder;
+
+        args[0] = "2"; /* OPEN_FILE */
+        args[1] = (current_folder != NULL) ? current_folder : "/tmp";
+        args[2] = data->multiple ? "1" : "0";
+        args[3] = data->directory ? "1" : "0";
+        args[4] = NULL;
+        return 4;
+    }
+    case SAVE_FILES: {
+        /* list of files is too big for arguments, it's passed in request record */
+        struct save_files_request_data *data = request_data;
+        const char *current_folder = data->current_folder;
+
+        args[0] = "1"; /* SAVE_FILES */
+        args[1] = (current_folder != NULL) ? current_folder : "/tmp";
+        args[2] = NULL;
+        return 2;
+    }
+    default:
+        log_print(ERROR, "UNREACHABLE: illegal request type");
+        abort();
+    }
+}
+
+/*
+ * posix_spawn_file_actions_adddup2() are performed in order, so make sure
+ * fds we are going to dup don't occupy fds 3, 4, 5 and 6 themselves.
+ */
+static int move_fd_out_of_the_way(int *fd) {
+    if (*fd > 6) {
+        return 0;
+    }
+
+    int new_fd = fcntl(*fd, F_DUPFD_CLOEXEC, 7);
+    if (new_fd < 0) {
+        return -errno;
+    }
+    close(*fd);
+    *fd = new_fd;
+
+    return 0;
+}
+
+/* same as move_fd_out_of_the_way() for fds owned by caller, new fd is put in dup_fd */
+static int dup_fd_out_of_the_way(int *fd, int *dup_fd) {
+    if (*fd < 0 || *fd > 6) {
+        return 0;
+    }
+
+    *dup_fd = fcntl(*fd, F_DUPFD_CLOEXEC, 7);
+    if (*dup_fd < 0) {
+        return -errno;
+    }
+    *fd = *dup_fd;
+
+    return 0;
+}
+
+int spawn_picker_direct(const char *exe, const char *const argv[], int record_fd,
+                        int result_fd, int *control_fd, pid_t *child_pid, int *child_pidfd) {
     int ret = 0;
     int pipe_fds[2] = {-1, -1};
+    int control_fds[2] = {-1, -1};
+    /* our own duplicates of record_fd and result_fd if they had to be moved */
+    int record_fd_dup = -1;
+    int result_fd_dup = -1;
+    bool file_actions_initialised = false;
+    bool attr_initialised = false;
+    posix_spawn_file_actions_t file_actions;
+    posix_spawnattr_t attr;
 
-    if (pipe(pipe_fds) < 0) {
+    /* everything is O_CLOEXEC, adddup2() clears it on fds that picker should get */
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
         ret = -errno;
         log_print(ERROR, "failed to create pipe: %s", strerror(errno));
         goto err;
     }
-
-    int flags = fcntl(pipe_fds[PIPE_READING_END], F_GETFL, 0);
-    if (flags < 0) {
+    if (fcntl(pipe_fds[PIPE_READING_END], F_SETFL, O_NONBLOCK) < 0) {
         ret = -errno;
-        log_print(ERROR, "fcntl() on fd %d failed: %s",
+        log_print(ERROR, "failed to set O_NONBLOCK on fd %d: %s",
                   pipe_fds[PIPE_READING_END], strerror(errno));
         goto err;
     }
-    if (fcntl(pipe_fds[PIPE_READING_END], F_SETFL, flags | O_NONBLOCK) < 0) {
-        ret = -errno;
-        log_print(ERROR, "failed to set O_NONBLOCK on fd %d: %s",
-                  pipe_fds[PIPE_READING_END], strerror(errno));
+    if ((ret = move_fd_out_of_the_way(&pipe_fds[PIPE_WRITING_END])) < 0) {
+        log_print(ERROR, "failed to duplicate fd %d: %s",
+                  pipe_fds[PIPE_WRITING_END], strerror(-ret));
         goto err;
     }
 
-    flags = fcntl(pipe_fds[PIPE_READING_END], F_GETFD, 0);
-    if (flags < 0) {
-        ret = -errno;
-        log_print(ERROR, "fcntl() on fd %d failed: %s",
-                  pipe_fds[PIPE_READING_END], strerror(errno));
+    if (control_fd != NULL) {
+        /* socket and not pipe so writing to it won't raise SIGPIPE if picker dies */
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, control_fds) < 0) {
+            ret = -errno;
+            log_print(ERROR, "failed to create control socket: %s", strerror(errno));
+            goto err;
+        }
+        if ((ret = move_fd_out_of_the_way(&control_fds[PIPE_READING_END])) < 0) {
+            log_print(ERROR, "failed to duplicate fd %d: %s",
+                      control_fds[PIPE_READING_END], strerror(-ret));
+            goto err;
+        }
+    }
+
+    if ((ret = dup_fd_out_of_the_way(&record_fd, &record_fd_dup)) < 0) {
+        log_print(ERROR, "failed to duplicate fd %d: %s", record_fd, strerror(-ret));
         goto err;
     }
-    if (fcntl(pipe_fds[PIPE_READING_END], F_SETFD, flags | FD_CLOEXEC) < 0) {
-        ret = -errno;
-        log_print(ERROR, "failed to set FD_CLOEXEC on fd %d: %s",
-                  pipe_fds[PIPE_READING_END], strerror(errno));
+    if ((ret = dup_fd_out_of_the_way(&result_fd, &result_fd_dup)) < 0) {
+        log_print(ERROR, "failed to duplicate fd %d: %s", result_fd, strerror(-ret));
+        goto err;
+    }
+
+    if ((ret = -posix_spawn_file_actions_init(&file_actions)) < 0) {
+        log_print(ERROR, "posix_spawn_file_actions_init() failed: %s", strerror(-ret));
+        goto err;
+    }
+    file_actions_initialised = true;
+    if ((ret = -posix_spawn_file_actions_adddup2(&file_actions,
+                                                 pipe_fds[PIPE_WRITING_END], 4)) < 0) {
+        log_print(ERROR, "posix_spawn_file_actions_adddup2() failed: %s", strerror(-ret));
+        goto err;
+    }
+    if (control_fd != NULL) {
+        if ((ret = -posix_spawn_file_actions_adddup2(&file_actions,
+                                                     control_fds[PIPE_READING_END], 3)) < 0) {
+            log_print(ERROR, "posix_spawn_file_actions_adddup2() failed: %s", strerror(-ret));
+            goto err;
+        }
+    }
+    if (record_fd >= 0) {
+        if ((ret = -posix_spawn_file_actions_adddup2(&file_actions, record_fd, 5)) < 0) {
+            log_print(ERROR, "posix_spawn_file_actions_adddup2() failed: %s", strerror(-ret));
+            goto err;
+        }
+    }
+    if (result_fd >= 0) {
+        if ((ret = -posix_spawn_file_actions_adddup2(&file_actions, result_fd, 6)) < 0) {
+            log_print(ERROR, "posix_spawn_file_actions_adddup2() failed: %s", strerror(-ret));
+            goto err;
+        }
+    }
+
+    if ((ret = -posix_spawnattr_init(&attr)) < 0) {
+        log_print(ERROR, "posix_spawnattr_init() failed: %s", strerror(-ret));
+        goto err;
+    }
+    attr_initialised = true;
+    /*
+     * Put picker in its own process group so we can kill it with all its children.
+     * Also reset signal mask, otherwise picker inherits signals blocked by the event loop.
+     */
+    sigset_t empty_sigset;
+    sigemptyset(&empty_sigset);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &empty_sigset);
+    if ((ret = -posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                                POSIX_SPAWN_SETSIGMASK)) < 0) {
+        log_print(ERROR, "posix_spawnattr_setflags() failed: %s", strerror(-ret));
         goto err;
     }
 
     pid_t pid;
-    switch (pid = fork()) {
-    case -1:
+    /* exe is a path already resolved at startup, no PATH search here */
+    if ((ret = -posix_spawn(&pid, exe, &file_actions, &attr,
+                            (char *const *)argv, environ)) < 0) {
+        log_print(ERROR, "failed to spawn %s: %s", exe, strerror(-ret));
+        goto err;
+    }
+    log_print(DEBUG, "spawned child with pid %d", pid);
+
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
         ret = -errno;
-        log_print(ERROR, "fork failed: %s", strerror(errno));
+        log_print(ERROR, "failed to open pidfd for child %d: %s", pid, strerror(errno));
+        kill(-pid, SIGKILL);
+        waitpid(pid, NULL, 0);
         goto err;
-    case 0:
-        /* child */
-        close(pipe_fds[PIPE_READING_END]);
-
-        if (dup2(pipe_fds[PIPE_WRITING_END], 4) < 0) {
-            log_print(ERROR, "picker: failed to duplicate pipe fd to fd 4: %s", strerror(errno));
-            exit(1);
-        };
-        close(pipe_fds[PIPE_WRITING_END]);
-
-        if (setpgid(0, 0) < 0) {
-            log_print(WARN, "setpgid() failed: %s, won't be able to kill picker", strerror(errno));
+    }
+
+    *child_pid = pid;
+    *child_pidfd = pidfd;
+
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (record_fd_dup >= 0) {
+        close(record_fd_dup);
+    }
+    if (result_fd_dup >= 0) {
+        close(result_fd_dup);
+    }
+    close(pipe_fds[PIPE_WRITING_END]);
+    if (control_fd != NULL) {
+        close(control_fds[PIPE_READING_END]);
+        *control_fd = control_fds[PIPE_WRITING_END];
+    }
+
+    return pipe_fds[PIPE_READING_END];
+
+err:
+    if (file_actions_initialised) {
+        posix_spawn_file_actions_destroy(&file_actions);
+    }
+    if (attr_initialised) {
+        posix_spawnattr_destroy(&attr);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pipe_fds[i] > 0) {
+            close(pipe_fds[i]);
         }
+        if (control_fds[i] > 0) {
+            close(control_fds[i]);
+        }
+    }
+    if (record_fd_dup >= 0) {
+        close(record_fd_dup);
+    }
+    if (result_fd_dup >= 0) {
+        close(result_fd_dup);
+    }
+    return ret;
+}
 
-        switch (request_type) {
-        case SAVE_FILE: {
-            struct save_file_request_data *data = request_data;
-            const char *current_name = data->current_name;
-            const char *current_folder = data->current_folder;
-            log_print(DEBUG, "picker: executing %s %d %s %s",
-                      exe, SAVE_FILE, current_folder, current_name);
-            execlp(exe, exe,
-                   "0", /* SAVE_FILE */
-                   (current_folder != NULL) ? current_folder : "/tmp",
-                   (current_name != NULL) ? current_name : "FALLBACK_FILENAME",
-                   NULL);
-            break;
+int spawn_picker(const char *exe, const char *const argv[], int record_fd, int result_fd,
+                 int *control_fd, pid_t *child_pid, int *child_pidfd) {
+    if (spawner_running()) {
+        int ret = spawner_spawn(exe, argv, record_fd, result_fd,
+                                control_fd, child_pid, child_pidfd);
+        /* only fall back if spawner itself is broken, not if exec failed */
+        if (ret >= 0 || spawner_running()) {
+            return ret;
         }
-        case OPEN_FILE: {
-            struct open_file_request_data *data = request_data;
-            const char *current_folder = data->current_folder;
-            int multiple = data->multiple;
-            int directory = data->directory;
-            log_print(DEBUG, "picker: executing %s %d %s %d %d",
-                      exe, OPEN_FILE, current_folder, multiple, directory);
-            execlp(exe, exe,
-                   "2", /* OPEN_FILE */
-                   (current_folder != NULL) ? current_folder : "/tmp",
-                   multiple ? "1" : "0",
-                   directory ? "1" : "0",
-                   NULL);
-            break;
+    }
+
+    return spawn_picker_direct(exe, argv, record_fd, result_fd,
+                               control_fd, child_pid, child_pidfd);
+}
+
+int exec_picker(const char *exe, const char *name,
+                enum filechooser_request_type request_type, void *request_data,
+                int record_fd, int result_fd, pid_t *child_pid, int *child_pidfd) {
+    const char *argv[PICKER_MAX_ARGS + 2];
+
+    argv[0] = name;
+    int n_args = picker_get_args(request_type, request_data, &argv[1]);
+
+    log_print(DEBUG, "picker: executing %s (%s)", name, exe);
+    for (int i = 1; i <= n_args; i++) {
+        log_print(DEBUG, "picker: argv[%d] = %s", i, argv[i]);
+    }
+
+    return spawn_picker(exe, argv, record_fd, result_fd, NULL, child_pid, child_pidfd);
+}
+
+int picker_create_result_memfd(void) {
+    /* sealed by daemon once picker is done, so it can be mapped safely */
+    int fd = memfd_create("xdptf-result", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -errno;
+    }
+    return fd;
+}
+
+int reap_picker(int pidfd) {
+    siginfo_t info = {0};
+    if (waitid(P_PIDFD, pidfd, &info, WEXITED | WNOHANG) < 0) {
+        if (errno != ECHILD) {
+            return -errno;
         }
-        case SAVE_FILES:
-            log_print(ERROR, "TODO: not implemented exec_picker() for this request type");
-            abort();
-            break;
-        default:
-            log_print(ERROR, "UNREACHABLE: illegal request type");
-            abort();
+
+        /* picker was spawned by spawner which reaps it, only check if it exited */
+        struct pollfd pollfd = { .fd = pidfd, .events = POLLIN };
+        if (poll(&pollfd, 1, 0) < 0) {
+            return -errno;
         }
+        return (pollfd.revents & POLLIN) ? 0 : -EAGAIN;
+    }
+    if (info.si_pid == 0) {
+        return -EAGAIN;
+    }
 
-        /* exec only returns on error */
-        log_print(ERROR, "child: execlp() failed: %s", strerror(errno));
-        exit(1);
-        break;
-    default:
-        /* parent continues... */
-        close(pipe_fds[PIPE_WRITING_END]);
-        log_print(DEBUG, "forked child with pid %d", pid);
-        *child_pid = pid;
-        break;
+    if (info.si_code == CLD_EXITED) {
+        log_print(DEBUG, "child %d exited with status %d", info.si_pid, info.si_status);
+    } else {
+        log_print(DEBUG, "child %d was killed by signal %d", info.si_pid, info.si_status);
     }
 
-    return pipe_fds[PIPE_READING_END];
+    return 0;
+}
 
-err:
-    if (pipe_fds[PIPE_READING_END] > 0) {
-        close(pipe_fds[PIPE_READING_END]);
+int kill_picker(pid_t pid, int pidfd, int sig) {
+    /* linux >= 6.9 can signal the whole process group through pidfd */
+    if (syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, PIDFD_SIGNAL_PROCESS_GROUP) == 0) {
+        return 0;
+    } else if (errno != EINVAL) {
+        return -errno;
     }
-    if (pipe_fds[PIPE_WRITING_END] > 0) {
-        close(pipe_fds[PIPE_WRITING_END]);
+
+    /*
+     * Older kernels: check through pidfd that picker still exists, only then signal
+     * its process group by pgid. Picker might have been reaped by spawner already,
+     * in which case its pid could have been reused by an unrelated process.
+     */
+    if (syscall(SYS_pidfd_send_signal, pidfd, 0, NULL, 0) < 0) {
+        return -errno;
     }
-    return ret;
+    if (kill(-pid, sig) < 0) {
+        return -errno;
+    }
+
+    return 0;
 }
 
+static int orphan_pidfd_event_handler(struct pollen_callback *callback,
+                                      int fd, uint32_t events, void *data) {
+    int ret = reap_picker(fd);
+    if (ret == -EAGAIN) {
+        return 0;
+    } else if (ret < 0) {
+        log_print(WARN, "failed to reap child: %s", strerror(-ret));
+    }
+
+    /* closes pidfd */
+    pollen_loop_remove_callback(callback);
+    return 0;
+}
+
+void reap_picker_later(struct pollen_loop *event_loop, int pidfd) {
+    if (reap_picker(pidfd) == 0) {
+        close(pidfd);
+        return;
+    }
+
+    if (pollen_loop_add_fd(event_loop, pidfd, EPOLLIN, true,
+                           orphan_pidfd_event_handler, NULL) == NULL) {
+        log_print(WARN, "failed to watch orphaned child, it will remain a zombie: %s",
+                  strerror(errno));
+        close(pidfd);
+    }
+}
+
+struct picker_terminator {
+    pid_t pid;
+    int pidfd;
+    struct pollen_callback *pidfd_callback;
+    struct pollen_callback *timer_callback;
+};
+
+static int terminator_pidfd_event_handler(struct pollen_callback *callback,
+                                          int fd, uint32_t events, void *data) {
+    struct picker_terminator *terminator = data;
+
+    int ret = reap_picker(fd);
+    if (ret == -EAGAIN) {
+        return 0;
+    } else if (ret < 0) {
+        log_print(WARN, "failed to reap picker %d: %s", terminator->pid, strerror(-ret));
+    }
+    log_print(DEBUG, "terminated picker %d exited", terminator->pid);
+
+    if (terminator->timer_callback != NULL) {
+        pollen_loop_remove_callback(terminator->timer_callback);
+    }
+    /* closes pidfd */
+    pollen_loop_remove_callback(callback);
+    free(terminator);
+
+    return 0;
+}
+
+static int terminator_timer_handler(struct pollen_callback *callback, void *data) {
+    struct picker_terminator *terminator = data;
+    int ret;
+
+    log_print(WARN, "picker %d ignored SIGTERM, sending SIGKILL", terminator->pid);
+    if ((ret = kill_picker(terminator->pid, terminator->pidfd, SIGKILL)) < 0) {
+        log_print(WARN, "failed to kill picker %d: %s", terminator->pid, strerror(-ret));
+    }
+
+    /* timers are periodic, one SIGKILL is enough */
+    pollen_loop_remove_callback(callback);
+    terminator->timer_callback = NULL;
+
+    return 0;
+}
+
+void terminate_picker(struct pollen_loop *event_loop, pid_t pid, int pidfd,
+                      unsigned long grace_period_ms) {
+    int ret;
+
+    if ((ret = kill_picker(pid, pidfd, SIGTERM)) < 0) {
+        /* most likely it has exited already */
+        log_print(DEBUG, "failed to send SIGTERM to picker %d: %s", pid, strerror(-ret));
+        reap_picker_later(event_loop, pidfd);
+        return;
+    }
+
+    struct picker_terminator *terminator = xcalloc(1, sizeof(*terminator));
+    terminator->pid = pid;
+    terminator->pidfd = pidfd;
+    terminator->pidfd_callback = pollen_loop_add_fd(event_loop, pidfd, EPOLLIN, true,
+                                                    terminator_pidfd_event_handler, terminator);
+    if (terminator->pidfd_callback == NULL) {
+        log_print(WARN, "failed to watch picker %d, killing it right away: %s",
+                  pid, strerror(errno));
+        kill_picker(pid, pidfd, SIGKILL);
+        free(terminator);
+        reap_picker_later(event_loop, pidfd);
+        return;
+    }
+
+    terminator->timer_callback = pollen_loop_add_timer(event_loop, grace_period_ms,
+                                                       terminator_timer_handler, terminator);
+    if (terminator->timer_callback == NULL) {
+        log_print(WARN, "failed to arm SIGKILL timer for picker %d: %s", pid, strerror(errno));
+    }
+}
@@ -2,10 +2,68 @@
 #define PICKER_H
 
 #include "filechooser.h"
+#include "pollen.h"
 
-/* returns pipe fd on success, negative errno retcode on failure */
-int exec_picker(const char *exe,
-                enum filechooser_request_type request_type, void *request_data, pid_t *child_pid);
+/* max number of arguments passed to picker, not counting argv[0] and NULL terminator */
+#define PICKER_MAX_ARGS 4
 
-#endif /* #ifndef PICKER_H */
+/* set to 1 in picker environment if paths have to be terminated with NUL instead of newline */
+#define PICKER_DELIMITER_ENV "TERMFILECHOOSER_NULL_DELIMITED"
+/* set to 1 in picker environment if picker gets result memfd on fd 6 */
+#define PICKER_RESULT_MEMFD_ENV "TERMFILECHOOSER_RESULT_MEMFD"
+
+/*
+ * fills args with NULL-terminated list of picker arguments (without argv[0]).
+ * strings in args point either to static storage or into request_data.
+ * returns number of arguments.
+ */
+int picker_get_args(enum filechooser_request_type request_type, void *request_data,
+                    const char *args[static PICKER_MAX_ARGS + 1]);
+
+/*
+ * spawns picker with given NULL-terminated argv.
+ * picker gets writing end of the pipe on fd 4.
+ * if record_fd is not -1, it is passed to picker as fd 5.
+ * if result_fd is not -1, it is passed to picker as fd 6.
+ * if control_fd is not NULL, a socket pair is created, one end is passed
+ * to picker as fd 3 and the other one is put in control_fd.
+ * pidfd of the picker is put in child_pidfd, picker must be reaped with reap_picker().
+ * picker is spawned by spawner if it is running.
+ * returns pipe fd on success, negative errno retcode on failure
+ */
+int spawn_picker(const char *exe, const char *const argv[], int record_fd, int result_fd,
+                 int *control_fd, pid_t *child_pid, int *child_pidfd);
+
+/* same as spawn_picker(), but always spawns from current process without using spawner */
+int spawn_picker_direct(const char *exe, const char *const argv[], int record_fd,
+                        int result_fd, int *control_fd, pid_t *child_pid, int *child_pidfd);
 
+/*
+ * exe is the path that gets executed, name is passed to picker as argv[0].
+ * returns pipe fd on success, negative errno retcode on failure
+ */
+int exec_picker(const char *exe, const char *name,
+                enum filechooser_request_type request_type, void *request_data,
+                int record_fd, int result_fd, pid_t *child_pid, int *child_pidfd);
+
+/*
+ * creates empty memfd for picker to write its result to, instead of the pipe.
+ * returns fd on success, negative errno retcode on failure
+ */
+int picker_create_result_memfd(void);
+
+/* reaps exited picker. returns 0 on success, -EAGAIN if it's still running */
+int reap_picker(int pidfd);
+/* sends signal to picker's process group. returns 0 on success, negative errno on failure */
+int kill_picker(pid_t pid, int pidfd, int sig);
+/* reaps picker once it exits and closes its pidfd. pidfd is owned by event loop after this */
+void reap_picker_later(struct pollen_loop *event_loop, int pidfd);
+/*
+ * sends SIGTERM to picker's process group, and SIGKILL if picker is still
+ * running after grace_period_ms. picker is reaped once it exits.
+ * pidfd is owned by event loop after this.
+ */
+void terminate_picker(struct pollen_loop *event_loop, pid_t pid, int pidfd,
+                      unsigned long grace_period_ms);
+
+#endif /* #ifndef PICKER_H */
@@ -0,0 +1,298 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "picker.h"
+#include "record.h"
+#include "xmalloc.h"
+#include "log.h"
+
+static void pool_worker_destroy(struct pool_worker *worker) {
+    int ret = kill_picker(worker->pid, worker->pidfd, SIGTERM);
+    if (ret < 0) {
+        log_print(WARN, "pool: failed to kill picker %d: %s", worker->pid, strerror(-ret));
+    }
+
+    pollen_loop_remove_callback(worker->pidfd_callback);
+    reap_picker_later(worker->pool->event_loop, worker->pidfd);
+
+    close(worker->control_fd);
+    close(worker->pipe_fd);
+    if (worker->record_fd >= 0) {
+        close(worker->record_fd);
+    }
+    if (worker->result_fd >= 0) {
+        close(worker->result_fd);
+    }
+    free(worker);
+}
+
+static int pool_worker_pidfd_event_handler(struct pollen_callback *callback,
+                                           int fd, uint32_t events, void *data) {
+    struct pool_worker *worker = data;
+    struct picker_pool *pool = worker->pool;
+
+    int ret = reap_picker(fd);
+    if (ret == -EAGAIN) {
+        return 0;
+    } else if (ret < 0) {
+        log_print(WARN, "pool: failed to reap picker %d: %s", worker->pid, strerror(-ret));
+    }
+
+    /*
+     * Do not respawn it right away, if picker exits immediately
+     * this would turn into a busy loop. Next request will refill.
+     */
+    log_print(WARN, "pool: idle picker %d exited", worker->pid);
+    LIST_REMOVE(worker, link);
+    pool->n_idle -= 1;
+
+    pollen_loop_remove_callback(worker->pidfd_callback);
+    close(worker->pidfd);
+    close(worker->control_fd);
+    close(worker->pipe_fd);
+    if (worker->record_fd >= 0) {
+        close(worker->record_fd);
+    }
+    if (worker->result_fd >= 0) {
+        close(worker->result_fd);
+    }
+    free(worker);
+
+    return 0;
+}
+
+static int pool_spawn_worker(struct picker_pool *pool) {
+    const char *argv[] = { pool->name, NULL };
+
+    struct pool_worker *worker = xcalloc(1, sizeof(*worker));
+    worker->pool = pool;
+    worker->record_fd = -1;
+    worker->result_fd = -1;
+    int ret = 0;
+    if (pool->with_record && (worker->record_fd = record_create_memfd()) < 0) {
+        ret = worker->record_fd;
+        log_print(ERROR, "pool: failed to create memfd: %s", strerror(-ret));
+        goto err;
+    }
+    if (pool->with_result && (worker->result_fd = picker_create_result_memfd()) < 0) {
+        ret = worker->result_fd;
+        log_print(ERROR, "pool: failed to create memfd: %s", strerror(-ret));
+        goto err;
+    }
+
+    ret = spawn_picker(pool->exe, argv, worker->record_fd, worker->result_fd,
+                       &worker->control_fd, &worker->pid, &worker->pidfd);
+    if (ret < 0) {
+        log_print(ERROR, "pool: failed to spawn picker: %s", strerror(-ret));
+        goto err;
+    }
+    worker->pipe_fd = ret;
+
+    worker->pidfd_callback = pollen_loop_add_fd(pool->event_loop, worker->pidfd, EPOLLIN, false,
+                                                pool_worker_pidfd_event_handler, worker);
+    if (worker->pidfd_callback == NULL) {
+        ret = -errno;
+        log_print(ERROR, "pool: failed to watch picker %d: %s", worker->pid, strerror(errno));
+        kill_picker(worker->pid, worker->pidfd, SIGTERM);
+        reap_picker_later(pool->event_loop, worker->pidfd);
+        close(worker->control_fd);
+        close(worker->pipe_fd);
+        goto err;
+    }
+
+    LIST_INSERT_HEAD(&pool->idle, worker, link);
+    pool->n_idle += 1;
+
+    log_print(DEBUG, "pool: spawned picker %d, %d/%d idle", worker->pid, pool->n_idle, pool->size);
+    return 0;
+
+err:
+    if (worker->record_fd >= 0) {
+        close(worker->record_fd);
+    }
+    if (worker->result_fd >= 0) {
+        close(worker->result_fd);
+    }
+    free(worker);
+    return ret;
+}
+
+static int pool_fill(struct picker_pool *pool) {
+    int ret = 0;
+    while (pool->n_idle < pool->size) {
+        if ((ret = pool_spawn_worker(pool)) < 0) {
+            break;
+        }
+    }
+    return ret;
+}
+
+static int pool_refill_callback(struct pollen_callback *callback, void *data) {
+    struct picker_pool *pool = data;
+
+    pollen_loop_remove_callback(pool->refill_callback);
+    pool->refill_callback = NULL;
+
+    /* failing to refill is not fatal, requests will cold-start pickers instead */
+    pool_fill(pool);
+
+    return 0;
+}
+
+static void pool_schedule_refill(struct picker_pool *pool) {
+    if (pool->refill_callback != NULL) {
+        return;
+    }
+
+    pool->refill_callback = pollen_loop_add_idle(pool->event_loop, 0, pool_refill_callback, pool);
+    if (pool->refill_callback == NULL) {
+        log_print(WARN, "pool: failed to schedule refill: %s", strerror(errno));
+    }
+}
+
+static int pool_send_args(struct pool_worker *worker, const char *const args[]) {
+    for (int i = 0; args[i] != NULL; i++) {
+        const struct iovec iov[] = {
+            { .iov_base = (void *)args[i], .iov_len = strlen(args[i]) },
+            { .iov_base = "\n", .iov_len = 1 },
+        };
+        struct msghdr msg = {
+            .msg_iov = (struct iovec *)iov,
+            .msg_iovlen = sizeof(iov) / sizeof(iov[0]),
+        };
+
+        size_t total = iov[0].iov_len + iov[1].iov_len;
+        ssize_t sent;
+        do {
+            sent = sendmsg(worker->control_fd, &msg, MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+        if (sent < 0) {
+            return -errno;
+        } else if ((size_t)sent != total) {
+            /* control socket is blocking, this only happens if picker went away mid-write */
+            return -EPIPE;
+        }
+    }
+
+    return 0;
+}
+
+int pool_exec_picker(struct picker_pool *pool, enum filechooser_request_type request_type,
+                     void *request_data, const struct ds *record, int *result_fd,
+                     pid_t *child_pid, int *child_pidfd) {
+    int ret = 0;
+    const char *args[PICKER_MAX_ARGS + 1];
+    picker_get_args(request_type, request_data, args);
+
+    /* idle pickers without record fd or result fd can't take requests that need one */
+    while (!LIST_EMPTY(&pool->idle) && (record == NULL || pool->with_record) &&
+            (result_fd == NULL || pool->with_result)) {
+        struct pool_worker *worker = LIST_FIRST(&pool->idle);
+        LIST_REMOVE(worker, link);
+        pool->n_idle -= 1;
+        pool_schedule_refill(pool);
+
+        /* record must be in place before picker gets arguments */
+        if (record != NULL && (ret = record_seal_memfd(worker->record_fd, record)) < 0) {
+            log_print(WARN, "pool: failed to write request record for picker %d: %s",
+                      worker->pid, strerror(-ret));
+            pool_worker_destroy(worker);
+            continue;
+        }
+
+        ret = pool_send_args(worker, args);
+        if (ret < 0) {
+            log_print(WARN, "pool: failed to hand request to picker %d: %s, trying next one",
+                      worker->pid, strerror(-ret));
+            pool_worker_destroy(worker);
+            continue;
+        }
+
+        log_print(DEBUG, "pool: handed request to picker %d", worker->pid);
+
+        int pipe_fd = worker->pipe_fd;
+        *child_pid = worker->pid;
+        *child_pidfd = worker->pidfd;
+        pollen_loop_remove_callback(worker->pidfd_callback);
+        /* picker gets EOF on fd 3 after last argument */
+        close(worker->control_fd);
+        if (worker->record_fd >= 0) {
+            close(worker->record_fd);
+        }
+        if (result_fd != NULL) {
+            *result_fd = worker->result_fd;
+        } else if (worker->result_fd >= 0) {
+            close(worker->result_fd);
+        }
+        free(worker);
+
+        return pipe_fd;
+    }
+
+    if (pool->size > 0) {
+        log_print(INFO, "pool: no idle pickers, starting a new one");
+    }
+
+    int record_fd = -1;
+    if (record != NULL && (record_fd = record_to_memfd(record)) < 0) {
+        log_print(ERROR, "pool: failed to create request record: %s", strerror(-record_fd));
+        return record_fd;
+    }
+    int new_result_fd = -1;
+    if (result_fd != NULL && (new_result_fd = picker_create_result_memfd()) < 0) {
+        ret = new_result_fd;
+        log_print(ERROR, "pool: failed to create result memfd: %s", strerror(-ret));
+        goto out;
+    }
+    ret = exec_picker(pool->exe, pool->name, request_type, request_data, record_fd,
+                      new_result_fd, child_pid, child_pidfd);
+    if (ret >= 0 && result_fd != NULL) {
+        *result_fd = new_result_fd;
+    } else if (new_result_fd >= 0) {
+        close(new_result_fd);
+    }
+
+out:
+    if (record_fd >= 0) {
+        close(record_fd);
+    }
+    return ret;
+}
+
+int pool_init(struct picker_pool *pool, struct pollen_loop *event_loop,
+              const char *exe, const char *name, bool with_record, bool with_result, int size) {
+    pool->exe = exe;
+    pool->name = name;
+    pool->with_record = with_record;
+    pool->with_result = with_result;
+    pool->event_loop = event_loop;
+    pool->size = size;
+    pool->n_idle = 0;
+    pool->refill_callback = NULL;
+    LIST_INIT(&pool->idle);
+
+    if (size > 0) {
+        log_print(INFO, "pool: starting %d pickers", size);
+    }
+
+    return pool_fill(pool);
+}
+
+void pool_cleanup(struct picker_pool *pool) {
+    if (pool->refill_callback != NULL) {
+        pollen_loop_remove_callback(pool->refill_callback);
+        pool->refill_callback = NULL;
+    }
+
+    struct pool_worker *worker, *worker_tmp;
+    LIST_FOREACH_SAFE(worker, &pool->idle, link, worker_tmp) {
+        LIST_REMOVE(worker, link);
+        pool_worker_destroy(worker);
+    }
+    pool->n_idle = 0;
+}
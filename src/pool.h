@@ -0,0 +1,79 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "filechooser.h"
+#include "pollen.h"
+#include "queue.h"
+#include "ds.h"
+
+/*
+ * Pool of pickers that were started in advance and are waiting for a request.
+ * Idle picker is started without arguments and blocks on reading fd 3. When
+ * request arrives, picker arguments are written to fd 3, one per line, and
+ * fd 3 is closed, so picker gets EOF after the last argument.
+ * Picker should bring up its UI (e.g. start the terminal) before reading fd 3,
+ * anything it does after that still delays the request.
+ * If pool is created with records, idle picker also gets an empty memfd on fd 5,
+ * which is filled with request record and sealed before arguments are written.
+ * If pool is created with result memfds, idle picker gets another empty memfd
+ * on fd 6, which is handed over to the request along with the pipe.
+ */
+
+struct pool_worker {
+    struct picker_pool *pool;
+
+    pid_t pid;
+    int pidfd;
+    /* fires if picker exits while idle */
+    struct pollen_callback *pidfd_callback;
+    /* our end of control socket, picker has the other one on fd 3 */
+    int control_fd;
+    /* reading end of result pipe, picker has writing end on fd 4 */
+    int pipe_fd;
+    /* empty memfd for request record, picker has it on fd 5. -1 if pool is without records */
+    int record_fd;
+    /* empty memfd for result, picker has it on fd 6. -1 if pool is without result memfds */
+    int result_fd;
+
+    LIST_ENTRY(pool_worker) link;
+};
+
+struct picker_pool {
+    /* see exec_picker() */
+    const char *exe;
+    const char *name;
+    struct pollen_loop *event_loop;
+    /* whether pickers get request record on fd 5 */
+    bool with_record;
+    /* whether pickers get result memfd on fd 6 */
+    bool with_result;
+
+    /* how many idle pickers to keep around */
+    int size;
+    int n_idle;
+    LIST_HEAD(pool_workers, pool_worker) idle;
+
+    /* pending refill, runs after everything else in current event loop iteration */
+    struct pollen_callback *refill_callback;
+};
+
+/* starts size pickers. pool with size 0 is valid and never starts anything */
+int pool_init(struct picker_pool *pool, struct pollen_loop *event_loop,
+              const char *exe, const char *name, bool with_record, bool with_result, int size);
+void pool_cleanup(struct picker_pool *pool);
+
+/*
+ * hands request to an idle picker, or cold-starts a new one if none are idle.
+ * record is passed to picker on fd 5. if pool is without records, requests with
+ * record are always cold-started.
+ * if result_fd is not NULL, picker gets result memfd on fd 6 and it's put in result_fd.
+ * returns pipe fd on success, negative errno retcode on failure (same as exec_picker).
+ */
+int pool_exec_picker(struct picker_pool *pool, enum filechooser_request_type request_type,
+                     void *request_data, const struct ds *record, int *result_fd,
+                     pid_t *child_pid, int *child_pidfd);
+
+#endif /* #ifndef POOL_H */
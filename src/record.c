@@ -0,0 +1,94 @@
+#define _GNU_SOURCE /* memfd_create(), F_ADD_SEALS */
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "record.h"
+
+void record_add(struct ds *record, const char *key, const char *value) {
+    ds_append_bytes(record, key, strlen(key));
+    ds_append_bytes(record, "=", 1);
+    /* include NUL terminator */
+    ds_append_bytes(record, value, strlen(value) + 1);
+}
+
+void record_add_int(struct ds *record, const char *key, long value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld", value);
+    record_add(record, key, buf);
+}
+
+bool record_next(const char **pos, const char *end, struct record_field *field) {
+    const char *start = *pos;
+    if (start >= end) {
+        return false;
+    }
+
+    const char *nul = memchr(start, '\0', end - start);
+    if (nul == NULL) {
+        return false;
+    }
+    const char *eq = memchr(start, '=', nul - start);
+    if (eq == NULL) {
+        return false;
+    }
+
+    field->key = start;
+    field->key_len = eq - start;
+    field->value = eq + 1;
+    field->value_len = nul - (eq + 1);
+
+    *pos = nul + 1;
+    return true;
+}
+
+bool record_field_is(const struct record_field *field, const char *key) {
+    return strlen(key) == field->key_len && memcmp(field->key, key, field->key_len) == 0;
+}
+
+int record_create_memfd(void) {
+    int fd = memfd_create("xdptf-request", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -errno;
+    }
+    return fd;
+}
+
+int record_seal_memfd(int fd, const struct ds *record) {
+    /* pwrite() so file offset stays at 0 for picker */
+    size_t written = 0;
+    while (written < record->length) {
+        ssize_t ret = pwrite(fd, record->data + written, record->length - written, written);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        written += ret;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+int record_to_memfd(const struct ds *record) {
+    int fd = record_create_memfd();
+    if (fd < 0) {
+        return fd;
+    }
+
+    int ret = record_seal_memfd(fd, record);
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
@@ -0,0 +1,45 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ds.h"
+
+/*
+ * Record is a sequence of key=value pairs, each one terminated by NUL byte.
+ * Keys can repeat, for example there is one path=... pair for every path.
+ * Values can contain anything except NUL, including '=' and newlines.
+ */
+
+struct record_field {
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+};
+
+void record_add(struct ds *record, const char *key, const char *value);
+void record_add_int(struct ds *record, const char *key, long value);
+
+/*
+ * Parses next pair from [*pos, end) and advances *pos past it.
+ * Returns false if there are no more pairs or the pair is malformed.
+ */
+bool record_next(const char **pos, const char *end, struct record_field *field);
+
+/* true if key of the field equals key */
+bool record_field_is(const struct record_field *field, const char *key);
+
+/*
+ * Records are handed to pickers in sealed memfds, which can't be modified or
+ * resized by anyone once sealed. All of these return negative errno on failure.
+ */
+/* creates empty memfd that can be filled later, returns fd */
+int record_create_memfd(void);
+/* writes record to empty memfd and seals it */
+int record_seal_memfd(int fd, const struct ds *record);
+/* same as record_create_memfd() followed by record_seal_memfd(), returns fd */
+int record_to_memfd(const struct ds *record);
+
+#endif /* #ifndef RECORD_H */
@@ -0,0 +1,465 @@
+#define _GNU_SOURCE /* SOCK_CLOEXEC, SOCK_NONBLOCK */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "remote.h"
+#include "xdptf.h"
+#include "record.h"
+#include "log.h"
+
+/* anything bigger than this is a protocol error */
+#define REMOTE_MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+/* requests go to local picker if server doesn't accept connection in this time */
+#define REMOTE_CONNECT_TIMEOUT_MS 500
+#define REMOTE_CONNECT_RETRY_MS 50
+
+static void remote_disconnect(struct remote_picker *remote) {
+    if (remote->fd < 0) {
+        return;
+    }
+
+    log_print(INFO, "remote: disconnecting from %s", remote->socket_path);
+
+    if (remote->fd_callback != NULL) {
+        /* closes fd */
+        pollen_loop_remove_callback(remote->fd_callback);
+        remote->fd_callback = NULL;
+    } else {
+        close(remote->fd);
+    }
+    remote->fd = -1;
+    if (remote->connect_timer != NULL) {
+        pollen_loop_remove_callback(remote->connect_timer);
+        remote->connect_timer = NULL;
+    }
+    filechooser_buffered_release(remote->xdptf, remote->n_buffered);
+    remote->n_buffered = 0;
+    ds_free(&remote->buffer);
+    ds_free(&remote->out);
+
+    /* if server was never reached, nothing was sent and requests can still go elsewhere */
+    bool connecting = remote->connecting;
+    remote->connecting = false;
+    remote->connect_again = false;
+
+    struct filechooser_request *request, *request_tmp;
+    LIST_FOREACH_SAFE(request, &remote->requests, remote_link, request_tmp) {
+        if (connecting) {
+            LIST_REMOVE(request, remote_link);
+            request->remote = false;
+            filechooser_request_start_local(request);
+        } else {
+            log_print(WARN, "remote: failing request %u", request->remote_id);
+            filechooser_request_fail(request);
+        }
+    }
+}
+
+/* sends as much of remote->out as socket takes, waits for EPOLLOUT if something is left */
+static int remote_flush(struct remote_picker *remote) {
+    int ret = 0;
+
+    while (remote->out.length > 0) {
+        ssize_t sent = send(remote->fd, remote->out.data, remote->out.length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -errno;
+        }
+        ds_consume(&remote->out, sent);
+    }
+
+    uint32_t events = EPOLLIN | (remote->out.length > 0 ? EPOLLOUT : 0);
+    if (pollen_fd_modify_events(remote->fd_callback, events) < 0) {
+        ret = -errno;
+        log_print(ERROR, "remote: failed to modify socket events: %s", strerror(errno));
+    }
+
+    return ret;
+}
+
+static int remote_fd_event_handler(struct pollen_callback *callback,
+                                   int fd, uint32_t events, void *data);
+
+static int remote_watch(struct remote_picker *remote, uint32_t events) {
+    remote->fd_callback = pollen_loop_add_fd(remote->event_loop, remote->fd, events, true,
+                                             remote_fd_event_handler, remote);
+    if (remote->fd_callback == NULL) {
+        int ret = -errno;
+        log_print(ERROR, "remote: failed to add socket to event loop: %s", strerror(errno));
+        return ret;
+    }
+
+    return 0;
+}
+
+static int remote_connected(struct remote_picker *remote) {
+    int ret = 0;
+
+    /* socket isn't watched while connect() is retried, unconnected socket is always EPOLLHUP */
+    if (remote->fd_callback == NULL && (ret = remote_watch(remote, EPOLLIN)) < 0) {
+        remote_disconnect(remote);
+        return ret;
+    }
+    remote->connecting = false;
+    remote->connect_again = false;
+    if (remote->connect_timer != NULL) {
+        pollen_loop_remove_callback(remote->connect_timer);
+        remote->connect_timer = NULL;
+    }
+    log_print(INFO, "remote: connected to %s", remote->socket_path);
+
+    if ((ret = remote_flush(remote)) < 0) {
+        log_print(ERROR, "remote: failed to send to picker server: %s", strerror(-ret));
+        remote_disconnect(remote);
+    }
+
+    return ret;
+}
+
+static void remote_handle_frame(struct remote_picker *remote, const char *frame, size_t len) {
+    const char *end = frame + len;
+    struct record_field field;
+
+    /* id must come first */
+    const char *pos = frame;
+    if (!record_next(&pos, end, &field) || !record_field_is(&field, "id")) {
+        log_print(WARN, "remote: got frame without id, ignoring");
+        return;
+    }
+    uint32_t id = strtoul(field.value, NULL, 10);
+
+    struct filechooser_request *request;
+    LIST_FOREACH(request, &remote->requests, remote_link) {
+        if (request->remote_id == id) {
+            break;
+        }
+    }
+    if (request == NULL) {
+        log_print(DEBUG, "remote: got result for unknown request %u, ignoring", id);
+        return;
+    }
+    /* server is done with it, so disconnecting doesn't fail it while paths are checked */
+    LIST_REMOVE(request, remote_link);
+    request->remote = false;
+
+    /* response can come after paths, find it first */
+    int response = -1;
+    const char *paths = pos;
+    while (record_next(&pos, end, &field)) {
+        if (record_field_is(&field, "response")) {
+            response = atoi(field.value);
+        } else if (!record_field_is(&field, "path")) {
+            log_print(DEBUG, "remote: unknown key %.*s, ignoring", (int)field.key_len, field.key);
+        }
+    }
+
+    int n_paths = 0;
+    /* paths are ignored if user cancelled */
+    if (response != 1 && response != 2) {
+        if (filechooser_request_add_output(request, len) < 0) {
+            filechooser_request_fail(request);
+            return;
+        }
+        pos = paths;
+        while (record_next(&pos, end, &field)) {
+            if (!record_field_is(&field, "path")) {
+                continue;
+            }
+            if (filechooser_request_add_path(request, field.value, field.value_len) < 0) {
+                filechooser_request_fail(request);
+                return;
+            }
+            n_paths += 1;
+        }
+    }
+    log_print(DEBUG, "remote: got result for request %u, response %d, %d paths",
+              id, response, n_paths);
+    /* whole result comes in one frame */
+    request->timestamps[STAGE_FIRST_BYTE] = request->timestamps[STAGE_EOF] = stats_now();
+
+    if (response == 2) {
+        filechooser_request_fail(request);
+    } else {
+        /* finalize sends cancelled response if there are no paths */
+        filechooser_request_finalize(request);
+    }
+}
+
+static int remote_fd_event_handler(struct pollen_callback *callback,
+                                   int fd, uint32_t events, void *data) {
+    struct remote_picker *remote = data;
+    int ret = 0;
+
+    if (remote->connecting) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0) {
+            error = errno;
+        }
+        if (error != 0) {
+            log_print(WARN, "remote: failed to connect to %s: %s",
+                      remote->socket_path, strerror(error));
+            remote_disconnect(remote);
+        } else {
+            remote_connected(remote);
+        }
+        return 0;
+    }
+
+    if ((events & EPOLLOUT) && (ret = remote_flush(remote)) < 0) {
+        log_print(ERROR, "remote: failed to send to picker server: %s", strerror(-ret));
+        remote_disconnect(remote);
+        return 0;
+    }
+
+    char buf[4096];
+    ssize_t bytes_read;
+    while ((bytes_read = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if (filechooser_buffered_add(remote->xdptf, bytes_read) < 0) {
+            log_print(ERROR, "remote: picker server went over max_buffered_size");
+            remote_disconnect(remote);
+            return 0;
+        }
+        remote->n_buffered += bytes_read;
+        ds_append_bytes(&remote->buffer, buf, bytes_read);
+    }
+    /* results that came in before EOF are still handled */
+    bool eof = (bytes_read == 0);
+    if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        log_print(ERROR, "remote: failed to read from picker server: %s", strerror(errno));
+        remote_disconnect(remote);
+        return 0;
+    }
+
+    while (remote->buffer.length >= sizeof(uint32_t)) {
+        uint32_t frame_len;
+        memcpy(&frame_len, remote->buffer.data, sizeof(frame_len));
+        if (frame_len > REMOTE_MAX_FRAME_SIZE) {
+            log_print(ERROR, "remote: frame is too big (%u bytes)", frame_len);
+            remote_disconnect(remote);
+            return 0;
+        }
+        if (remote->buffer.length - sizeof(frame_len) < frame_len) {
+            /* wait for the rest */
+            break;
+        }
+
+        /* request counts the frame from here on */
+        filechooser_buffered_release(remote->xdptf, sizeof(frame_len) + frame_len);
+        remote->n_buffered -= sizeof(frame_len) + frame_len;
+        remote_handle_frame(remote, remote->buffer.data + sizeof(frame_len), frame_len);
+        /* handling frame might have disconnected us */
+        if (remote->fd < 0) {
+            break;
+        }
+        ds_consume(&remote->buffer, sizeof(frame_len) + frame_len);
+    }
+
+    if (eof) {
+        log_print(WARN, "remote: picker server closed connection");
+        remote_disconnect(remote);
+    }
+
+    return 0;
+}
+
+/* returns 0 if connected, -EINPROGRESS or -EAGAIN if it has to be waited for */
+static int remote_try_connect(struct remote_picker *remote) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, remote->socket_path);
+
+    while (connect(remote->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+static int remote_connect_timer_handler(struct pollen_callback *callback, void *data) {
+    struct remote_picker *remote = data;
+    int ret = 0;
+
+    remote->connect_elapsed_ms += REMOTE_CONNECT_RETRY_MS;
+    if (remote->connect_again) {
+        ret = remote_try_connect(remote);
+        if (ret == 0) {
+            remote_connected(remote);
+            return 0;
+        } else if (ret == -EINPROGRESS) {
+            if (remote_watch(remote, EPOLLOUT) < 0) {
+                remote_disconnect(remote);
+                return 0;
+            }
+            remote->connect_again = false;
+        } else if (ret != -EAGAIN) {
+            log_print(WARN, "remote: failed to connect to %s: %s",
+                      remote->socket_path, strerror(-ret));
+            remote_disconnect(remote);
+            return 0;
+        }
+    }
+
+    if (remote->connect_elapsed_ms >= REMOTE_CONNECT_TIMEOUT_MS) {
+        log_print(WARN, "remote: timed out connecting to %s", remote->socket_path);
+        remote_disconnect(remote);
+    }
+
+    return 0;
+}
+
+static int remote_connect(struct remote_picker *remote) {
+    int ret = 0;
+
+    if (strlen(remote->socket_path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path)) {
+        log_print(ERROR, "remote: socket path %s is too long", remote->socket_path);
+        return -ENAMETOOLONG;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ret = -errno;
+        log_print(ERROR, "remote: failed to create socket: %s", strerror(errno));
+        return ret;
+    }
+    remote->fd = fd;
+
+    ret = remote_try_connect(remote);
+    if (ret < 0 && ret != -EINPROGRESS && ret != -EAGAIN) {
+        log_print(WARN, "remote: failed to connect to %s: %s",
+                  remote->socket_path, strerror(-ret));
+        goto err;
+    }
+    ds_init(&remote->buffer);
+    ds_init(&remote->out);
+
+    if (ret == 0) {
+        if (remote_watch(remote, EPOLLIN) < 0) {
+            goto err;
+        }
+        log_print(INFO, "remote: connected to %s", remote->socket_path);
+        return 0;
+    }
+
+    /* EAGAIN means server's backlog is full, connect() is retried from timer then */
+    if (ret == -EINPROGRESS && (ret = remote_watch(remote, EPOLLOUT)) < 0) {
+        goto err;
+    }
+    log_print(DEBUG, "remote: waiting for %s to accept connection", remote->socket_path);
+    remote->connecting = true;
+    remote->connect_again = (remote->fd_callback == NULL);
+    remote->connect_elapsed_ms = 0;
+    remote->connect_timer = pollen_loop_add_timer(remote->event_loop, REMOTE_CONNECT_RETRY_MS,
+                                                  remote_connect_timer_handler, remote);
+    if (remote->connect_timer == NULL) {
+        ret = -errno;
+        log_print(ERROR, "remote: failed to arm connect timer: %s", strerror(errno));
+        remote_disconnect(remote);
+        return ret;
+    }
+
+    return 0;
+
+err:
+    close(fd);
+    remote->fd = -1;
+    ds_free(&remote->buffer);
+    ds_free(&remote->out);
+    return ret;
+}
+
+/* queues frame and sends it right away if socket takes it */
+static int remote_send_frame(struct remote_picker *remote, const struct ds *record) {
+    uint32_t frame_len = record->length;
+    ds_append_bytes(&remote->out, &frame_len, sizeof(frame_len));
+    ds_append_bytes(&remote->out, record->data, record->length);
+
+    if (remote->connecting) {
+        return 0;
+    }
+    return remote_flush(remote);
+}
+
+int remote_send_request(struct remote_picker *remote, struct filechooser_request *request) {
+    int ret = 0;
+
+    if (remote->fd < 0 && (ret = remote_connect(remote)) < 0) {
+        return ret;
+    }
+
+    uint32_t id = remote->next_id++;
+
+    struct ds record;
+    ds_init(&record);
+    record_add_int(&record, "id", id);
+    filechooser_request_build_record(request, &record);
+
+    ret = remote_send_frame(remote, &record);
+    ds_free(&record);
+    if (ret < 0) {
+        log_print(ERROR, "remote: failed to send request: %s", strerror(-ret));
+        remote_disconnect(remote);
+        return ret;
+    }
+
+    log_print(DEBUG, "remote: %s request %u", remote->connecting ? "queued" : "sent", id);
+    request->remote = true;
+    request->remote_id = id;
+    LIST_INSERT_HEAD(&remote->requests, request, remote_link);
+
+    return 0;
+}
+
+void remote_cancel_request(struct remote_picker *remote, struct filechooser_request *request) {
+    if (remote->fd < 0) {
+        return;
+    }
+
+    struct ds record;
+    ds_init(&record);
+    record_add_int(&record, "id", request->remote_id);
+    record_add_int(&record, "cancel", 1);
+
+    int ret = remote_send_frame(remote, &record);
+    ds_free(&record);
+    if (ret < 0) {
+        log_print(WARN, "remote: failed to send cancel for request %u: %s",
+                  request->remote_id, strerror(-ret));
+    }
+}
+
+void remote_init(struct remote_picker *remote, struct xdptf *xdptf, const char *socket_path) {
+    remote->socket_path = socket_path;
+    remote->xdptf = xdptf;
+    remote->event_loop = xdptf->event_loop;
+    remote->n_buffered = 0;
+    remote->fd = -1;
+    remote->fd_callback = NULL;
+    remote->connecting = false;
+    remote->connect_again = false;
+    remote->connect_timer = NULL;
+    remote->next_id = 1;
+    ds_init(&remote->buffer);
+    ds_init(&remote->out);
+    LIST_INIT(&remote->requests);
+
+    if (socket_path != NULL) {
+        /* server might not be up yet, it's fine */
+        remote_connect(remote);
+    }
+}
+
+void remote_cleanup(struct remote_picker *remote) {
+    remote_disconnect(remote);
+}
@@ -0,0 +1,75 @@
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "filechooser.h"
+#include "pollen.h"
+#include "queue.h"
+#include "ds.h"
+
+/*
+ * Remote picker is a long-running picker server that the daemon talks to over
+ * a unix stream socket, instead of starting a new picker for every request.
+ * Many requests can be in flight over a single connection.
+ *
+ * Every message in both directions is a frame: 32-bit length in native byte
+ * order, followed by that many bytes of record (see record.h).
+ *
+ * Daemon sends:
+ *   request: id=N followed by the same record that pickers get on fd 5,
+ *            see filechooser_request_build_record()
+ *   cancel:  id=N cancel=1
+ * Server sends:
+ *   result:  id=N [response=R] path=... path=...
+ *            R is 0 for success, 1 if user cancelled, 2 on error.
+ *            If response is omitted, result is a success if it has paths.
+ */
+
+struct xdptf;
+
+struct remote_picker {
+    /* NULL if remote picker is not configured */
+    const char *socket_path;
+    struct xdptf *xdptf;
+    struct pollen_loop *event_loop;
+
+    /* -1 if not connected */
+    int fd;
+    struct pollen_callback *fd_callback;
+    /* incomplete frames */
+    struct ds buffer;
+    /* bytes of buffer counted against max_buffered_size, frames are counted by request once handled */
+    size_t n_buffered;
+    /* frames that socket didn't take yet, sent on EPOLLOUT */
+    struct ds out;
+
+    /* connect() didn't finish yet, frames wait in out */
+    bool connecting;
+    /* connect() has to be retried, server's backlog was full */
+    bool connect_again;
+    /* retries connect() and gives up after REMOTE_CONNECT_TIMEOUT_MS */
+    struct pollen_callback *connect_timer;
+    unsigned long connect_elapsed_ms;
+
+    uint32_t next_id;
+    /* requests waiting for result */
+    LIST_HEAD(remote_requests, filechooser_request) requests;
+};
+
+/* connects to picker server at socket_path. if it's not up yet, connects on first request */
+void remote_init(struct remote_picker *remote, struct xdptf *xdptf, const char *socket_path);
+void remote_cleanup(struct remote_picker *remote);
+
+/*
+ * sends request to picker server. on success, the request is tracked by remote
+ * until it gets a result or is cleaned up. returns 0 on success, negative errno on failure.
+ * if server doesn't accept the connection in time, tracked requests are handed
+ * to filechooser_request_start_local().
+ */
+int remote_send_request(struct remote_picker *remote, struct filechooser_request *request);
+/* tells picker server the request was closed. request must still be cleaned up */
+void remote_cancel_request(struct remote_picker *remote, struct filechooser_request *request);
+
+#endif /* #ifndef REMOTE_H */
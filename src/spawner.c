@@ -0,0 +1,372 @@
+#define _GNU_SOURCE /* SOCK_CLOEXEC, MSG_CMSG_CLOEXEC */
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "spawner.h"
+#include "picker.h"
+#include "log.h"
+
+/* big enough for PICKER_MAX_ARGS paths */
+#define SPAWNER_MSG_MAX (PICKER_MAX_ARGS * 4096 + 4096)
+/* pipe fd, pidfd, control fd */
+#define SPAWNER_MAX_FDS 3
+
+/* request is followed by exe and then argc NUL-terminated strings, argv[0] first */
+/* record fd and result fd, if any, are passed along with the request in this order */
+struct spawner_request {
+    uint32_t argc;
+    uint32_t with_control_fd;
+    uint32_t with_record_fd;
+    uint32_t with_result_fd;
+};
+
+/* reply carries pipe fd, pidfd and control fd (if requested) in this order */
+struct spawner_reply {
+    int32_t error;
+    int32_t pid;
+};
+
+static struct {
+    int socket_fd;
+    pid_t pid;
+} spawner = {
+    .socket_fd = -1,
+    .pid = -1,
+};
+
+static ssize_t send_with_fds(int sock, const void *buf, size_t len, const int *fds, int n_fds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SPAWNER_MAX_FDS)];
+        struct cmsghdr align;
+    } cmsg_buf;
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+
+    if (n_fds > 0) {
+        memset(&cmsg_buf, 0, sizeof(cmsg_buf));
+        msg.msg_control = cmsg_buf.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+    }
+
+    ssize_t ret;
+    do {
+        ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+/* received fds are O_CLOEXEC. returns number of bytes received, fds count is put in n_fds */
+static ssize_t recv_with_fds(int sock, void *buf, size_t len, int *fds, int *n_fds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SPAWNER_MAX_FDS)];
+        struct cmsghdr align;
+    } cmsg_buf;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cmsg_buf.buf,
+        .msg_controllen = sizeof(cmsg_buf.buf),
+    };
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *n_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+        *n_fds = n;
+    }
+
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        for (int i = 0; i < *n_fds; i++) {
+            close(fds[i]);
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return ret;
+}
+
+static void spawner_handle_request(int sock, char *buf, size_t len,
+                                   const int *request_fds, int n_request_fds) {
+    struct spawner_reply reply = {0};
+    int fds[SPAWNER_MAX_FDS];
+    int n_fds = 0;
+
+    struct spawner_request request;
+    const char *exe;
+    const char *argv[PICKER_MAX_ARGS + 2];
+    if (len < sizeof(request)) {
+        reply.error = EINVAL;
+        goto out;
+    }
+    memcpy(&request, buf, sizeof(request));
+    if (request.argc < 1 || request.argc > PICKER_MAX_ARGS + 1) {
+        reply.error = EINVAL;
+        goto out;
+    }
+    if (n_request_fds != (request.with_record_fd ? 1 : 0) + (request.with_result_fd ? 1 : 0)) {
+        reply.error = EINVAL;
+        goto out;
+    }
+    int record_fd = request.with_record_fd ? request_fds[0] : -1;
+    int result_fd = request.with_result_fd ? request_fds[n_request_fds - 1] : -1;
+
+    /* buf is always NUL-terminated past len, so the last string can't run away */
+    char *p = buf + sizeof(request);
+    if (p >= buf + len) {
+        reply.error = EINVAL;
+        goto out;
+    }
+    exe = p;
+    p += strlen(p) + 1;
+    for (uint32_t i = 0; i < request.argc; i++) {
+        if (p >= buf + len) {
+            reply.error = EINVAL;
+            goto out;
+        }
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[request.argc] = NULL;
+
+    pid_t pid;
+    int pidfd, control_fd;
+    /* picker that exits right away must not be reaped before its pidfd is opened */
+    sigset_t sigchld_sigset, old_sigset;
+    sigemptyset(&sigchld_sigset);
+    sigaddset(&sigchld_sigset, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld_sigset, &old_sigset);
+    int ret = spawn_picker_direct(exe, argv, record_fd, result_fd,
+                                  request.with_control_fd ? &control_fd : NULL, &pid, &pidfd);
+    sigprocmask(SIG_SETMASK, &old_sigset, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+        goto out;
+    }
+
+    reply.pid = pid;
+    fds[n_fds++] = ret;
+    fds[n_fds++] = pidfd;
+    if (request.with_control_fd) {
+        fds[n_fds++] = control_fd;
+    }
+
+out:
+    if (send_with_fds(sock, &reply, sizeof(reply), fds, n_fds) < 0) {
+        log_print(ERROR, "spawner: failed to send reply: %s", strerror(errno));
+    }
+    for (int i = 0; i < n_fds; i++) {
+        close(fds[i]);
+    }
+}
+
+static void sigchld_handler(int signal) {
+    int saved_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        /* nothing */
+    }
+    errno = saved_errno;
+}
+
+static void spawner_main(int sock) {
+    /*
+     * pickers are reaped by spawner as soon as they exit, daemon watches them
+     * with pidfds. SA_NOCLDWAIT would be simpler, but then picker that exits
+     * right away is gone before its pidfd can be opened.
+     */
+    struct sigaction sa = {
+        .sa_handler = sigchld_handler,
+        .sa_flags = SA_RESTART | SA_NOCLDSTOP,
+    };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+        log_print(WARN, "spawner: failed to set SIGCHLD handler: %s", strerror(errno));
+    }
+
+    static char buf[SPAWNER_MSG_MAX + 1];
+    while (true) {
+        int fds[SPAWNER_MAX_FDS];
+        int n_fds;
+        ssize_t len = recv_with_fds(sock, buf, SPAWNER_MSG_MAX, fds, &n_fds);
+        if (len < 0) {
+            log_print(ERROR, "spawner: failed to receive request: %s", strerror(errno));
+            _exit(1);
+        } else if (len == 0) {
+            log_print(DEBUG, "spawner: daemon closed connection, exiting");
+            _exit(0);
+        }
+        buf[len] = '\0';
+        spawner_handle_request(sock, buf, len, fds, n_fds);
+
+        for (int i = 0; i < n_fds; i++) {
+            close(fds[i]);
+        }
+    }
+}
+
+int spawner_init(void) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) < 0) {
+        int ret = -errno;
+        log_print(ERROR, "spawner: failed to create socket pair: %s", strerror(errno));
+        return ret;
+    }
+
+    pid_t pid = fork();
+    switch (pid) {
+    case -1: {
+        int ret = -errno;
+        log_print(ERROR, "spawner: fork failed: %s", strerror(errno));
+        close(sockets[0]);
+        close(sockets[1]);
+        return ret;
+    }
+    case 0:
+        close(sockets[0]);
+        spawner_main(sockets[1]);
+        _exit(0);
+    default:
+        close(sockets[1]);
+        spawner.socket_fd = sockets[0];
+        spawner.pid = pid;
+        log_print(INFO, "spawner: started with pid %d", pid);
+        return 0;
+    }
+}
+
+void spawner_cleanup(void) {
+    if (spawner.socket_fd >= 0) {
+        /* spawner exits when it gets EOF */
+        close(spawner.socket_fd);
+        spawner.socket_fd = -1;
+    }
+    if (spawner.pid > 0) {
+        waitpid(spawner.pid, NULL, 0);
+        spawner.pid = -1;
+    }
+}
+
+bool spawner_running(void) {
+    return spawner.socket_fd >= 0;
+}
+
+static int append_string(char buf[static SPAWNER_MSG_MAX], size_t *len, const char *str) {
+    size_t str_len = strlen(str) + 1;
+    if (*len + str_len > SPAWNER_MSG_MAX) {
+        log_print(ERROR, "spawner: arguments are too long");
+        return -1;
+    }
+    memcpy(buf + *len, str, str_len);
+    *len += str_len;
+    return 0;
+}
+
+int spawner_spawn(const char *exe, const char *const argv[], int record_fd, int result_fd,
+                  int *control_fd, pid_t *child_pid, int *child_pidfd) {
+    static char buf[SPAWNER_MSG_MAX];
+    int ret = 0;
+
+    struct spawner_request request = {
+        .argc = 0,
+        .with_control_fd = (control_fd != NULL),
+        .with_record_fd = (record_fd >= 0),
+        .with_result_fd = (result_fd >= 0),
+    };
+    int request_fds[2];
+    int n_request_fds = 0;
+    if (record_fd >= 0) {
+        request_fds[n_request_fds++] = record_fd;
+    }
+    if (result_fd >= 0) {
+        request_fds[n_request_fds++] = result_fd;
+    }
+    size_t len = sizeof(request);
+    if (append_string(buf, &len, exe) < 0) {
+        return -E2BIG;
+    }
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (append_string(buf, &len, argv[i]) < 0) {
+            return -E2BIG;
+        }
+        request.argc += 1;
+    }
+    memcpy(buf, &request, sizeof(request));
+
+    if (send_with_fds(spawner.socket_fd, buf, len, request_fds, n_request_fds) < 0) {
+        ret = -errno;
+        log_print(ERROR, "spawner: failed to send request: %s", strerror(errno));
+        goto err;
+    }
+
+    struct spawner_reply reply;
+    int fds[SPAWNER_MAX_FDS];
+    int n_fds;
+    ssize_t reply_len = recv_with_fds(spawner.socket_fd, &reply, sizeof(reply), fds, &n_fds);
+    if (reply_len < 0) {
+        ret = -errno;
+        log_print(ERROR, "spawner: failed to receive reply: %s", strerror(errno));
+        goto err;
+    } else if (reply_len != sizeof(reply)) {
+        ret = -EPROTO;
+        log_print(ERROR, "spawner: connection closed or got malformed reply");
+        for (int i = 0; i < n_fds; i++) {
+            close(fds[i]);
+        }
+        goto err;
+    }
+
+    if (reply.error != 0) {
+        log_print(ERROR, "spawner: failed to spawn %s: %s", exe, strerror(reply.error));
+        return -reply.error;
+    }
+    if (n_fds != ((control_fd != NULL) ? 3 : 2)) {
+        log_print(ERROR, "spawner: got %d fds in reply", n_fds);
+        for (int i = 0; i < n_fds; i++) {
+            close(fds[i]);
+        }
+        return -EPROTO;
+    }
+
+    log_print(DEBUG, "spawner: spawned child with pid %d", reply.pid);
+    *child_pid = reply.pid;
+    *child_pidfd = fds[1];
+    if (control_fd != NULL) {
+        *control_fd = fds[2];
+    }
+    return fds[0];
+
+err:
+    /* spawner is gone or confused, don't talk to it anymore */
+    log_print(WARN, "spawner: giving up on spawner, pickers will be spawned by daemon itself");
+    close(spawner.socket_fd);
+    spawner.socket_fd = -1;
+    return ret;
+}
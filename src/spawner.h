@@ -0,0 +1,24 @@
+#ifndef SPAWNER_H
+#define SPAWNER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Spawner is a tiny helper process forked at startup, before dbus and event loop
+ * are initialised. It spawns pickers on behalf of the daemon and passes their fds
+ * back over a socket, so spawn cost doesn't depend on how big the daemon has grown.
+ * Pickers are children of spawner, which reaps them automatically.
+ */
+
+/* forks spawner process. on failure, pickers are spawned by the daemon itself */
+int spawner_init(void);
+void spawner_cleanup(void);
+
+bool spawner_running(void);
+
+/* same as spawn_picker() */
+int spawner_spawn(const char *exe, const char *const argv[], int record_fd, int result_fd,
+                  int *control_fd, pid_t *child_pid, int *child_pidfd);
+
+#endif /* #ifndef SPAWNER_H */
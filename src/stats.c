@@ -0,0 +1,211 @@
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "stats.h"
+#include "log.h"
+#include "xmalloc.h"
+
+static const char *stage_names[STAGE_COUNT] = {
+    [STAGE_RECEIVED] = "received",
+    [STAGE_DEQUEUED] = "queue_wait",
+    [STAGE_SPAWN_STARTED] = "dispatch",
+    [STAGE_SPAWNED] = "spawn",
+    [STAGE_FIRST_BYTE] = "first_byte",
+    [STAGE_EOF] = "eof",
+    [STAGE_REAPED] = "reap",
+    [STAGE_REPLIED] = "reply",
+};
+
+static const char *type_names[STATS_N_TYPES] = {
+    "save_file",
+    "save_files",
+    "open_file",
+};
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void histogram_add(struct stats_histogram *histogram, uint64_t duration_ns) {
+    uint64_t us = duration_ns / 1000;
+
+    int bucket = 0;
+    while (us >> bucket != 0 && bucket < STATS_N_BUCKETS - 1) {
+        bucket += 1;
+    }
+
+    histogram->count += 1;
+    histogram->buckets[bucket] += 1;
+    if (us > histogram->max_us) {
+        histogram->max_us = us;
+    }
+}
+
+/* returns upper bound of the bucket where percentile falls, in microseconds */
+static uint64_t histogram_percentile(const struct stats_histogram *histogram, int percentile) {
+    uint64_t rank = (histogram->count * percentile + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_N_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = (uint64_t)1 << i;
+            return (upper < histogram->max_us) ? upper : histogram->max_us;
+        }
+    }
+    return histogram->max_us;
+}
+
+static void set_add(struct stats_set *set, const uint64_t timestamps[static STAGE_COUNT]) {
+    uint64_t prev = timestamps[STAGE_RECEIVED];
+    for (int i = STAGE_RECEIVED + 1; i < STAGE_COUNT; i++) {
+        if (timestamps[i] == 0) {
+            continue;
+        }
+        /* picker can exit before we see EOF on its pipe, stages are not strictly ordered */
+        histogram_add(&set->stages[i], (timestamps[i] > prev) ? timestamps[i] - prev : 0);
+        if (timestamps[i] > prev) {
+            prev = timestamps[i];
+        }
+    }
+    histogram_add(&set->total, prev - timestamps[STAGE_RECEIVED]);
+}
+
+static struct stats_app *stats_get_app(struct request_stats *stats, const char *app_id) {
+    struct stats_app *app;
+    LIST_FOREACH(app, &stats->apps, link) {
+        if (strcmp(app->app_id, app_id) == 0) {
+            return app;
+        }
+    }
+
+    if (stats->n_apps >= STATS_MAX_APPS) {
+        return &stats->other_apps;
+    }
+
+    app = xcalloc(1, sizeof(*app));
+    app->app_id = xstrdup(app_id);
+    LIST_INSERT_HEAD(&stats->apps, app, link);
+    stats->n_apps += 1;
+
+    return app;
+}
+
+void stats_add_request(struct request_stats *stats, int type,
+                       const char *app_id, const uint64_t timestamps[static STAGE_COUNT]) {
+    if (timestamps[STAGE_RECEIVED] == 0 || type < 0 || type >= STATS_N_TYPES) {
+        return;
+    }
+
+    set_add(&stats->types[type], timestamps);
+    if (app_id == NULL || app_id[0] == '\0') {
+        /* host apps don't have app_id */
+        app_id = "(none)";
+    }
+    set_add(&stats_get_app(stats, app_id)->set, timestamps);
+}
+
+void stats_queue_changed(struct request_stats *stats, int queue_depth) {
+    if (queue_depth > stats->queue_depth) {
+        stats->n_queued += 1;
+    }
+    stats->queue_depth = queue_depth;
+    if (queue_depth > stats->queue_depth_max) {
+        stats->queue_depth_max = queue_depth;
+    }
+}
+
+void stats_add_rejected(struct request_stats *stats) {
+    stats->n_rejected += 1;
+}
+
+void stats_buffered_changed(struct request_stats *stats, uint64_t buffered_bytes) {
+    stats->buffered_bytes = buffered_bytes;
+    if (buffered_bytes > stats->buffered_bytes_max) {
+        stats->buffered_bytes_max = buffered_bytes;
+    }
+}
+
+void stats_add_over_limit(struct request_stats *stats) {
+    stats->n_over_limit += 1;
+}
+
+void stats_add_bus_wakeup(struct request_stats *stats, int n_messages, bool exhausted) {
+    stats->n_bus_wakeups += 1;
+    stats->n_bus_messages += n_messages;
+    if ((uint64_t)n_messages > stats->bus_messages_max) {
+        stats->bus_messages_max = n_messages;
+    }
+    if (exhausted) {
+        stats->n_bus_exhausted += 1;
+    }
+}
+
+void stats_add_bus_flush(struct request_stats *stats) {
+    stats->n_bus_flushes += 1;
+}
+
+static void histogram_dump(const char *name, const struct stats_histogram *histogram) {
+    if (histogram->count == 0) {
+        return;
+    }
+    log_print(INFO, "stats:     %-10s n=%-6lu p50<=%luus p99<=%luus max=%luus", name,
+              (unsigned long)histogram->count,
+              (unsigned long)histogram_percentile(histogram, 50),
+              (unsigned long)histogram_percentile(histogram, 99),
+              (unsigned long)histogram->max_us);
+}
+
+static void set_dump(const char *name, const struct stats_set *set) {
+    if (set->total.count == 0) {
+        return;
+    }
+    log_print(INFO, "stats:   %s", name);
+    for (int i = STAGE_RECEIVED + 1; i < STAGE_COUNT; i++) {
+        histogram_dump(stage_names[i], &set->stages[i]);
+    }
+    histogram_dump("total", &set->total);
+}
+
+void stats_dump(struct request_stats *stats) {
+    log_print(INFO, "stats: queue: depth %d, max depth %d, queued %lu, rejected %lu",
+              stats->queue_depth, stats->queue_depth_max,
+              (unsigned long)stats->n_queued, (unsigned long)stats->n_rejected);
+    log_print(INFO, "stats: picker output: buffered %lu bytes, max %lu bytes, over limits %lu",
+              (unsigned long)stats->buffered_bytes, (unsigned long)stats->buffered_bytes_max,
+              (unsigned long)stats->n_over_limit);
+    log_print(INFO, "stats: dbus: wakeups %lu, messages %lu, max per wakeup %lu, "
+              "out of budget %lu, flushes %lu",
+              (unsigned long)stats->n_bus_wakeups, (unsigned long)stats->n_bus_messages,
+              (unsigned long)stats->bus_messages_max, (unsigned long)stats->n_bus_exhausted,
+              (unsigned long)stats->n_bus_flushes);
+
+    log_print(INFO, "stats: per request type:");
+    for (int i = 0; i < STATS_N_TYPES; i++) {
+        set_dump(type_names[i], &stats->types[i]);
+    }
+
+    log_print(INFO, "stats: per app:");
+    struct stats_app *app;
+    LIST_FOREACH(app, &stats->apps, link) {
+        set_dump(app->app_id, &app->set);
+    }
+    set_dump("(other apps)", &stats->other_apps.set);
+}
+
+void stats_init(struct request_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    LIST_INIT(&stats->apps);
+}
+
+void stats_cleanup(struct request_stats *stats) {
+    struct stats_app *app, *app_tmp;
+    LIST_FOREACH_SAFE(app, &stats->apps, link, app_tmp) {
+        LIST_REMOVE(app, link);
+        free(app->app_id);
+        free(app);
+    }
+    stats->n_apps = 0;
+}
@@ -0,0 +1,106 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "queue.h"
+
+/*
+ * Request latency statistics. Every request records monotonic timestamps of the
+ * stages it goes through, and when it's done, time spent between consecutive
+ * stages is added to histograms, per request type and per app_id.
+ * Histograms are dumped to the log on SIGUSR1.
+ */
+
+enum request_stage {
+    /* dbus method was called */
+    STAGE_RECEIVED = 0,
+    /* left the queue, only for requests that had to wait for a free picker slot */
+    STAGE_DEQUEUED,
+    /* started spawning picker, or handing request to pool or picker server */
+    STAGE_SPAWN_STARTED,
+    /* picker is executing and has the request */
+    STAGE_SPAWNED,
+    STAGE_FIRST_BYTE,
+    STAGE_EOF,
+    STAGE_REAPED,
+    /* response was sent */
+    STAGE_REPLIED,
+    STAGE_COUNT,
+};
+
+/* bucket i counts durations in [2^(i-1), 2^i) microseconds, bucket 0 is < 1us */
+#define STATS_N_BUCKETS 40
+/* number of request types, see enum filechooser_request_type */
+#define STATS_N_TYPES 3
+/* requests from apps past this many get accounted under one shared entry */
+#define STATS_MAX_APPS 64
+
+struct stats_histogram {
+    uint64_t count;
+    uint64_t max_us;
+    uint64_t buckets[STATS_N_BUCKETS];
+};
+
+/* one histogram per stage, stage i holds time from previous reached stage to i */
+struct stats_set {
+    struct stats_histogram stages[STAGE_COUNT];
+    /* from STAGE_RECEIVED to the last reached stage */
+    struct stats_histogram total;
+};
+
+struct stats_app {
+    char *app_id;
+    struct stats_set set;
+    LIST_ENTRY(stats_app) link;
+};
+
+struct request_stats {
+    /* indexed by enum filechooser_request_type */
+    struct stats_set types[STATS_N_TYPES];
+    int n_apps;
+    LIST_HEAD(stats_apps, stats_app) apps;
+    struct stats_app other_apps;
+
+    /* requests waiting for a free picker slot */
+    int queue_depth;
+    int queue_depth_max;
+    uint64_t n_queued;
+    /* requests rejected because queue was full */
+    uint64_t n_rejected;
+
+    /* picker output held by requests that are not finished yet */
+    uint64_t buffered_bytes;
+    uint64_t buffered_bytes_max;
+    /* requests ended because picker output went over limits */
+    uint64_t n_over_limit;
+
+    /* dbus messages processed per event loop wakeup */
+    uint64_t n_bus_wakeups;
+    uint64_t n_bus_messages;
+    uint64_t bus_messages_max;
+    /* wakeups that ran out of dbus_process_budget */
+    uint64_t n_bus_exhausted;
+    /* flushes that found replies still waiting in write queue */
+    uint64_t n_bus_flushes;
+};
+
+/* monotonic time in nanoseconds */
+uint64_t stats_now(void);
+
+void stats_init(struct request_stats *stats);
+void stats_cleanup(struct request_stats *stats);
+
+/* timestamps of stages that weren't reached must be 0 */
+void stats_add_request(struct request_stats *stats, int type,
+                       const char *app_id, const uint64_t timestamps[static STAGE_COUNT]);
+void stats_queue_changed(struct request_stats *stats, int queue_depth);
+void stats_add_rejected(struct request_stats *stats);
+void stats_buffered_changed(struct request_stats *stats, uint64_t buffered_bytes);
+void stats_add_over_limit(struct request_stats *stats);
+void stats_add_bus_wakeup(struct request_stats *stats, int n_messages, bool exhausted);
+void stats_add_bus_flush(struct request_stats *stats);
+void stats_dump(struct request_stats *stats);
+
+#endif /* #ifndef STATS_H */
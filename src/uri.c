@@ -1,8 +1,14 @@
 #include <string.h>
 #include <stdbool.h>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "uri.h"
-#include "xmalloc.h"
+#include "log.h"
 
 /*
  * If you stumbled upon this code, try putting this function into godbolt
@@ -14,83 +20,240 @@ static inline bool needs_encoding(char c) {
     return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~' || c == '/');
 }
 
-/* returns a malloc'd string */
-static char *uri_encode(const char *str) {
-    /* several war crimes against programming have been commited */
-    static const char prefix[] = "file://";
-
-    /* prefix size + string size * 3 (%XX) + null terminator */
-    size_t buf_len = strlen(prefix) + (strlen(str) * 3) + 1;
-    char *uri = xmalloc(buf_len);
-
-    const char *src;
-    char *dst = stpcpy(uri, prefix);
-    unsigned char c;
-    for (src = str; (c = *src) != '\0'; src++) {
-        if (needs_encoding(c)) {
-            unsigned char low = (c & 0x0F);
-            unsigned char high = (c >> 4);
-            *dst++ = '%';
-            *dst++ = (high < 10) ? (high + '0') : (high + 'A' - 10);
-            *dst++ = (low < 10) ? (low + '0') : (low + 'A' - 10);
-        } else {
-            *dst++ = c;
+/*
+ * vectorized versions classify a whole vector of bytes at once using the same
+ * rules as needs_encoding(): c | 0x20 folds A-Z into a-z, and "-./" are right
+ * before digits in ascii, so only two ranges and two single characters are left.
+ * bytes >= 0x80 are negative as signed chars, so they fall outside every range.
+ */
+
+struct uri_encoder {
+    const char *name;
+    /* returns number of leading bytes of str that don't need encoding */
+    size_t (*safe_span)(const char *str, size_t len);
+    /* returns number of bytes of str that need encoding */
+    size_t (*count_unsafe)(const char *str, size_t len);
+};
+
+static size_t scalar_safe_span(const char *str, size_t len) {
+    size_t i = 0;
+    while (i < len && !needs_encoding(str[i])) {
+        i += 1;
+    }
+    return i;
+}
+
+static size_t scalar_count_unsafe(const char *str, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        n += needs_encoding(str[i]);
+    }
+    return n;
+}
+
+#if defined(__SSE2__)
+
+/* returns bitmask of bytes that need encoding */
+static inline unsigned sse2_unsafe_bits(__m128i v) {
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                  _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('-' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i other = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+    __m128i safe = _mm_or_si128(_mm_or_si128(alpha, digit), other);
+    return (unsigned)_mm_movemask_epi8(safe) ^ 0xFFFF;
+}
+
+static size_t sse2_safe_span(const char *str, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        unsigned bits = sse2_unsafe_bits(_mm_loadu_si128((const __m128i *)(str + i)));
+        if (bits != 0) {
+            return i + __builtin_ctz(bits);
         }
     }
-    *dst = '\0';
+    return i + scalar_safe_span(str + i, len - i);
+}
 
-    return uri;
+static size_t sse2_count_unsafe(const char *str, size_t len) {
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        n += __builtin_popcount(sse2_unsafe_bits(_mm_loadu_si128((const __m128i *)(str + i))));
+    }
+    return n + scalar_count_unsafe(str + i, len - i);
 }
 
-/*
- * puts null-terminated malloc'd array of malloc'd strings in res.
- * returns number of items in array without null terminator.
- * if number of items is 0, do not free the array!
- */
-int get_uris_from_string(char *str, char ***res) {
-    if (str == NULL) {
-        *res = NULL;
-        return 0;
+static const struct uri_encoder sse2_encoder = {
+    .name = "sse2",
+    .safe_span = sse2_safe_span,
+    .count_unsafe = sse2_count_unsafe,
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_AVX2_ENCODER
+
+__attribute__((target("avx2")))
+static inline unsigned avx2_unsafe_bits(__m256i v) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('-' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i other = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')),
+                                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~')));
+    __m256i safe = _mm256_or_si256(_mm256_or_si256(alpha, digit), other);
+    return ~(unsigned)_mm256_movemask_epi8(safe);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_safe_span(const char *str, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned bits = avx2_unsafe_bits(_mm256_loadu_si256((const __m256i *)(str + i)));
+        if (bits != 0) {
+            return i + __builtin_ctz(bits);
+        }
     }
+    return i + sse2_safe_span(str + i, len - i);
+}
 
-    char **uris;
-
-    /*
-     * last line can not end with newline, I don't handle this case here and
-     * assume that every lines ends with newline (and there are no empty ones)
-     * also this algo is SLOW AS BALLS and I hate it
-     */
-    int n_lines = 0;
-    for (char *p = str; *p != '\0'; p++) {
-        if (*p == '\n') {
-            n_lines += 1;
+__attribute__((target("avx2")))
+static size_t avx2_count_unsafe(const char *str, size_t len) {
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        n += __builtin_popcount(avx2_unsafe_bits(_mm256_loadu_si256((const __m256i *)(str + i))));
+    }
+    return n + sse2_count_unsafe(str + i, len - i);
+}
+
+static const struct uri_encoder avx2_encoder = {
+    .name = "avx2",
+    .safe_span = avx2_safe_span,
+    .count_unsafe = avx2_count_unsafe,
+};
+
+#endif /* if defined(__x86_64__) && defined(__GNUC__) */
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+/* returns 0xFF for every byte that needs encoding */
+static inline uint8x16_t neon_unsafe_mask(uint8x16_t v) {
+    uint8x16_t lower = vorrq_u8(v, vdupq_n_u8(0x20));
+    /* unsigned compares, so bytes >= 0x80 are out of range too */
+    uint8x16_t alpha = vcleq_u8(vsubq_u8(lower, vdupq_n_u8('a')), vdupq_n_u8('z' - 'a'));
+    uint8x16_t digit = vcleq_u8(vsubq_u8(v, vdupq_n_u8('-')), vdupq_n_u8('9' - '-'));
+    uint8x16_t other = vorrq_u8(vceqq_u8(v, vdupq_n_u8('_')), vceqq_u8(v, vdupq_n_u8('~')));
+    return vmvnq_u8(vorrq_u8(vorrq_u8(alpha, digit), other));
+}
+
+static size_t neon_safe_span(const char *str, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t mask = neon_unsafe_mask(vld1q_u8((const uint8_t *)(str + i)));
+        /* narrow every byte of the mask to 4 bits, there is no movemask */
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+        if (bits != 0) {
+            return i + (__builtin_ctzll(bits) >> 2);
         }
     }
+    return i + scalar_safe_span(str + i, len - i);
+}
 
-    if (n_lines == 0) {
-        return 0;
+static size_t neon_count_unsafe(const char *str, size_t len) {
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t mask = neon_unsafe_mask(vld1q_u8((const uint8_t *)(str + i)));
+        n += vaddvq_u8(vshrq_n_u8(mask, 7));
     }
+    return n + scalar_count_unsafe(str + i, len - i);
+}
 
-    /* +1 for null terminator at the end */
-    uris = xmalloc((n_lines + 1) * sizeof(char *));
+static const struct uri_encoder neon_encoder = {
+    .name = "neon",
+    .safe_span = neon_safe_span,
+    .count_unsafe = neon_count_unsafe,
+};
 
-    int i = 0;
-    char *line_start = str;
-    for (char *p = line_start; *p != '\0'; p++) {
-        if (*p == '\n') {
-            *p = '\0'; /* replace newline with null terminator */
+#else
 
-            char *uri;
-            uri = uri_encode(line_start);
+static const struct uri_encoder scalar_encoder = {
+    .name = "scalar",
+    .safe_span = scalar_safe_span,
+    .count_unsafe = scalar_count_unsafe,
+};
+
+#endif
+
+static const struct uri_encoder *get_encoder(void) {
+    static const struct uri_encoder *encoder = NULL;
+    if (encoder != NULL) {
+        return encoder;
+    }
 
-            uris[i++] = uri;
-            line_start = p + 1;
+#if defined(HAVE_AVX2_ENCODER)
+    encoder = __builtin_cpu_supports("avx2") ? &avx2_encoder : &sse2_encoder;
+#elif defined(__SSE2__)
+    encoder = &sse2_encoder;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    encoder = &neon_encoder;
+#else
+    encoder = &scalar_encoder;
+#endif
+
+    log_print(DEBUG, "uri: using %s encoder", encoder->name);
+    return encoder;
+}
+
+/* returns size of percent-encoded len bytes of str, without null terminator */
+static size_t encoded_len(const struct uri_encoder *encoder, const char *str, size_t len) {
+    return len + (encoder->count_unsafe(str, len) * 2);
+}
+
+/* percent-encodes len bytes of str into dst, which must have encoded_len() + 1 bytes. returns end of dst */
+static char *encode_into(const struct uri_encoder *encoder, char *dst, const char *str, size_t len) {
+    while (len > 0) {
+        /* copy plain runs in bulk */
+        size_t span = encoder->safe_span(str, len);
+        memcpy(dst, str, span);
+        dst += span;
+        str += span;
+        len -= span;
+        if (len == 0) {
+            break;
         }
+
+        unsigned char c = *str;
+        unsigned char low = (c & 0x0F);
+        unsigned char high = (c >> 4);
+        *dst++ = '%';
+        *dst++ = (high < 10) ? (high + '0') : (high + 'A' - 10);
+        *dst++ = (low < 10) ? (low + '0') : (low + 'A' - 10);
+        str += 1;
+        len -= 1;
     }
-    uris[i] = NULL;
+    *dst = '\0';
+
+    return dst;
+}
 
-    *res = uris;
+static const char uri_prefix[] = "file://";
 
-    return n_lines;
+void uri_append_encoded(struct ds *uri, const char *str, size_t len) {
+    const struct uri_encoder *encoder = get_encoder();
+
+    size_t encoded = encoded_len(encoder, str, len);
+    encode_into(encoder, ds_reserve(uri, encoded), str, len);
+    ds_commit(uri, encoded);
 }
 
+void uri_append_path(struct ds *uri, const char *path, size_t len) {
+    /* several war crimes against programming have been commited */
+    ds_append_bytes(uri, uri_prefix, strlen(uri_prefix));
+    uri_append_encoded(uri, path, len);
+}
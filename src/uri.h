@@ -1,7 +1,13 @@
 #ifndef URI_H
 #define URI_H
 
-int get_uris_from_string(char *str, char ***res);
+#include <stddef.h>
 
-#endif /* #ifndef URI_H */
+#include "ds.h"
+
+/* appends file:// uri for len bytes of path to uri */
+void uri_append_path(struct ds *uri, const char *path, size_t len);
+/* appends percent-encoded len bytes of str to uri, e.g. a file name after directory uri */
+void uri_append_encoded(struct ds *uri, const char *str, size_t len);
 
+#endif /* #ifndef URI_H */
@@ -0,0 +1,184 @@
+#define _GNU_SOURCE /* statx(), AT_STATX_DONT_SYNC */
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "validator.h"
+#include "log.h"
+
+void validator_check_path(struct path_check *check) {
+    struct statx stx;
+    /* cached attributes are good enough, don't make network filesystems sync */
+    if (statx(AT_FDCWD, check->path, AT_STATX_DONT_SYNC, STATX_TYPE, &stx) < 0) {
+        check->error = -errno;
+        check->is_dir = false;
+        return;
+    }
+    check->error = 0;
+    check->is_dir = S_ISDIR(stx.stx_mode);
+}
+
+static void *validator_thread(void *data) {
+    struct validator *validator = data;
+
+    pthread_mutex_lock(&validator->lock);
+    while (true) {
+        while (!validator->stop && TAILQ_EMPTY(&validator->pending)) {
+            pthread_cond_wait(&validator->cond, &validator->lock);
+        }
+        if (validator->stop) {
+            break;
+        }
+
+        struct validator_job *job = TAILQ_FIRST(&validator->pending);
+        TAILQ_REMOVE(&validator->pending, job, link);
+        validator->current = job;
+        pthread_mutex_unlock(&validator->lock);
+
+        for (int i = 0; i < job->n_checks; i++) {
+            validator_check_path(&job->checks[i]);
+        }
+
+        pthread_mutex_lock(&validator->lock);
+        validator->current = NULL;
+        TAILQ_INSERT_TAIL(&validator->done, job, link);
+        uint64_t one = 1;
+        /* can only fail if counter overflows, and then event loop wakes up anyway */
+        (void)!write(validator->event_fd, &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&validator->lock);
+
+    return NULL;
+}
+
+static struct validator_job *validator_pop_done(struct validator *validator) {
+    pthread_mutex_lock(&validator->lock);
+    struct validator_job *job = TAILQ_FIRST(&validator->done);
+    if (job != NULL) {
+        TAILQ_REMOVE(&validator->done, job, link);
+    }
+    pthread_mutex_unlock(&validator->lock);
+    return job;
+}
+
+static int validator_event_handler(struct pollen_callback *callback,
+                                   int fd, uint32_t events, void *data) {
+    struct validator *validator = data;
+
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_print(ERROR, "validator: failed to read eventfd: %s", strerror(errno));
+    }
+
+    /* one at a time, done callbacks may cancel other jobs */
+    struct validator_job *job;
+    while ((job = validator_pop_done(validator)) != NULL) {
+        job->done(job, job->data);
+    }
+
+    return 0;
+}
+
+void validator_submit(struct validator *validator, struct validator_job *job) {
+    job->cancelled = false;
+
+    pthread_mutex_lock(&validator->lock);
+    TAILQ_INSERT_TAIL(&validator->pending, job, link);
+    pthread_cond_signal(&validator->cond);
+    pthread_mutex_unlock(&validator->lock);
+}
+
+static bool jobs_remove(struct validator_jobs *jobs, struct validator_job *job) {
+    struct validator_job *iter;
+    TAILQ_FOREACH(iter, jobs, link) {
+        if (iter == job) {
+            TAILQ_REMOVE(jobs, job, link);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool validator_cancel(struct validator *validator, struct validator_job *job) {
+    bool in_use = false;
+
+    pthread_mutex_lock(&validator->lock);
+    if (validator->current == job) {
+        job->cancelled = true;
+        in_use = true;
+    } else if (!jobs_remove(&validator->pending, job)) {
+        jobs_remove(&validator->done, job);
+    }
+    pthread_mutex_unlock(&validator->lock);
+
+    return in_use;
+}
+
+int validator_init(struct validator *validator, struct pollen_loop *event_loop) {
+    int ret = 0;
+
+    memset(validator, 0, sizeof(*validator));
+    TAILQ_INIT(&validator->pending);
+    TAILQ_INIT(&validator->done);
+    pthread_mutex_init(&validator->lock, NULL);
+    pthread_cond_init(&validator->cond, NULL);
+
+    validator->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (validator->event_fd < 0) {
+        ret = -errno;
+        log_print(ERROR, "validator: eventfd() failed: %s", strerror(errno));
+        goto err;
+    }
+    validator->event_callback = pollen_loop_add_fd(event_loop, validator->event_fd,
+                                                   EPOLLIN, true,
+                                                   validator_event_handler, validator);
+    if (validator->event_callback == NULL) {
+        ret = -errno;
+        log_print(ERROR, "validator: failed to add eventfd to event loop: %s", strerror(errno));
+        close(validator->event_fd);
+        goto err;
+    }
+
+    /* thread inherits signal mask, signals must already be blocked for signalfd */
+    if ((ret = -pthread_create(&validator->thread, NULL, validator_thread, validator)) < 0) {
+        log_print(ERROR, "validator: pthread_create() failed: %s", strerror(-ret));
+        pollen_loop_remove_callback(validator->event_callback);
+        goto err;
+    }
+    validator->running = true;
+
+    return 0;
+
+err:
+    validator->event_callback = NULL;
+    pthread_cond_destroy(&validator->cond);
+    pthread_mutex_destroy(&validator->lock);
+    return ret;
+}
+
+void validator_cleanup(struct validator *validator) {
+    if (!validator->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&validator->lock);
+    validator->stop = true;
+    pthread_cond_signal(&validator->cond);
+    pthread_mutex_unlock(&validator->lock);
+    pthread_join(validator->thread, NULL);
+    validator->running = false;
+
+    /* these were cancelled while running and are waiting to be freed */
+    struct validator_job *job;
+    while ((job = validator_pop_done(validator)) != NULL) {
+        job->done(job, job->data);
+    }
+
+    pollen_loop_remove_callback(validator->event_callback);
+    pthread_cond_destroy(&validator->cond);
+    pthread_mutex_destroy(&validator->lock);
+}
@@ -0,0 +1,75 @@
+#ifndef VALIDATOR_H
+#define VALIDATOR_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "pollen.h"
+#include "queue.h"
+
+/*
+ * Checks paths returned by pickers on a separate thread, so a slow or hung
+ * mount can't stall the event loop. Every job is a batch of paths, they are
+ * stat'ed with statx(AT_STATX_DONT_SYNC) and job's done callback is called
+ * from the event loop once the whole batch is checked.
+ */
+
+struct path_check {
+    const char *path;
+    /* filled by validator: 0 or negative errno */
+    int error;
+    bool is_dir;
+};
+
+struct validator_job;
+typedef void (*validator_done_fn)(struct validator_job *job, void *data);
+
+struct validator_job {
+    struct path_check *checks;
+    int n_checks;
+    /* called from event loop when job is done or, if it was cancelled while running, freeable */
+    validator_done_fn done;
+    void *data;
+    /* job was cancelled while validator thread was working on it */
+    bool cancelled;
+
+    TAILQ_ENTRY(validator_job) link;
+};
+
+TAILQ_HEAD(validator_jobs, validator_job);
+
+struct validator {
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+
+    /* everything below is protected by lock */
+    struct validator_jobs pending;
+    /* job that validator thread is working on right now */
+    struct validator_job *current;
+    /* jobs that wait for their done callback to be called */
+    struct validator_jobs done;
+
+    /* signalled by validator thread when there is something in done */
+    int event_fd;
+    struct pollen_callback *event_callback;
+};
+
+/* returns negative errno on failure, validator can't be used then */
+int validator_init(struct validator *validator, struct pollen_loop *event_loop);
+void validator_cleanup(struct validator *validator);
+
+void validator_submit(struct validator *validator, struct validator_job *job);
+/* checks path right away on calling thread, for when validator isn't running */
+void validator_check_path(struct path_check *check);
+/*
+ * job's done callback won't be called with results. returns false if job is
+ * not used by validator anymore. if validator thread is working on the job right
+ * now, returns true, and done callback will be called with job->cancelled set
+ * when job's memory can be freed.
+ */
+bool validator_cancel(struct validator *validator, struct validator_job *job);
+
+#endif /* #ifndef VALIDATOR_H */
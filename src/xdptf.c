@@ -1,5 +1,4 @@
 #include <sys/signalfd.h>
-#include <sys/wait.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -10,6 +9,8 @@
 #include "xdptf.h"
 #include "filechooser.h"
 #include "dbus.h"
+#include "spawner.h"
+#include "picker.h"
 #include "xmalloc.h"
 #include "log.h"
 
@@ -28,19 +29,6 @@ static void print_usage_and_exit(FILE *stream, int retcode) {
     exit(retcode);
 }
 
-int dbus_event_handler(struct pollen_callback *callback, int fd, uint32_t events, void *data) {
-    struct sd_bus *bus = data;
-
-    log_print(DEBUG, "processing dbus events");
-    int ret;
-    if ((ret = sd_bus_process(bus, NULL)) < 0) {
-        log_print(ERROR, "failed to process dbus events: %s", strerror(-ret));
-        return ret;
-    }
-
-    return 0;
-}
-
 int sigint_sigterm_handler(struct pollen_callback *callback, int signal, void *data) {
     log_print(INFO, "caught signal %d, exiting", signal);
 
@@ -49,27 +37,10 @@ int sigint_sigterm_handler(struct pollen_callback *callback, int signal, void *d
     return 0;
 }
 
-int sigchld_handler(struct pollen_callback *callback, int signal, void *data) {
+int sigusr1_handler(struct pollen_callback *callback, int signal, void *data) {
     struct xdptf *xdptf = data;
 
-    log_print(DEBUG, "caught SIGCHLD %d, running reaper", signal);
-
-    pid_t pid;
-    int wstatus;
-    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
-        if (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus)) {
-            continue;
-        }
-
-        log_print(DEBUG, "child %d exited", pid);
-        struct filechooser_request *request, *request_tmp;
-        LIST_FOREACH_SAFE(request, &xdptf->requests, link, request_tmp) {
-            if (request->picker_pid == pid) {
-                log_print(DEBUG, "found request associated with child %d, finalizing it", pid);
-                filechooser_request_finalize(request);
-            }
-        }
-    }
+    stats_dump(&xdptf->stats);
 
     return 0;
 }
@@ -132,6 +103,10 @@ int main(int argc, char **argv) {
         log_init(stderr, INFO);
     }
 
+    stats_init(&xdptf.stats);
+    TAILQ_INIT(&xdptf.queued_requests);
+    hashmap_init(&xdptf.requests_by_handle);
+
     if (config_init(&xdptf.config, config_path) < 0) {
         log_print(ERROR, "failed to parse config");
         retcode = 1;
@@ -143,6 +118,23 @@ int main(int argc, char **argv) {
         log_init(stderr, xdptf.config.loglevel);
     }
 
+    /* tells pickers how to terminate paths and where to write them, inherited by every picker */
+    if (xdptf.config.null_delimited) {
+        setenv(PICKER_DELIMITER_ENV, "1", 1);
+    } else {
+        unsetenv(PICKER_DELIMITER_ENV);
+    }
+    if (xdptf.config.result_memfd) {
+        setenv(PICKER_RESULT_MEMFD_ENV, "1", 1);
+    } else {
+        unsetenv(PICKER_RESULT_MEMFD_ENV);
+    }
+
+    /* fork it before anything else grows the process */
+    if (spawner_init() < 0) {
+        log_print(WARN, "failed to start spawner, pickers will be spawned by daemon itself");
+    }
+
     if (dbus_init(&xdptf, replace) < 0) {
         log_print(ERROR, "failed to initialise dbus");
         retcode = 1;
@@ -155,11 +147,25 @@ int main(int argc, char **argv) {
         retcode = 1;
         goto cleanup;
     }
-    pollen_loop_add_fd(xdptf.event_loop, xdptf.sd_bus_fd, EPOLLIN, false,
-                       dbus_event_handler, xdptf.sd_bus);
+    if (dbus_attach_event_loop(&xdptf) < 0) {
+        log_print(ERROR, "failed to add dbus to event loop");
+        retcode = 1;
+        goto cleanup;
+    }
     pollen_loop_add_signal(xdptf.event_loop, SIGINT, sigint_sigterm_handler, NULL);
     pollen_loop_add_signal(xdptf.event_loop, SIGTERM, sigint_sigterm_handler, NULL);
-    pollen_loop_add_signal(xdptf.event_loop, SIGCHLD, sigchld_handler, &xdptf);
+    pollen_loop_add_signal(xdptf.event_loop, SIGUSR1, sigusr1_handler, &xdptf);
+
+    if (pool_init(&xdptf.pool, xdptf.event_loop,
+                  xdptf.config.picker_exe, xdptf.config.picker_cmd,
+                  xdptf.config.request_record, xdptf.config.result_memfd,
+                  xdptf.config.pool_size) < 0) {
+        log_print(WARN, "failed to fill picker pool, pickers will be started on demand");
+    }
+    remote_init(&xdptf.remote, &xdptf, xdptf.config.picker_socket);
+    if (validator_init(&xdptf.validator, xdptf.event_loop) < 0) {
+        log_print(WARN, "failed to start validator, returned paths will be checked on main thread");
+    }
 
     retcode = pollen_loop_run(xdptf.event_loop);
 
@@ -169,8 +175,15 @@ cleanup: {} /* Label followed by a declaration is a C23 extension */
         filechooser_request_cleanup(request);
     };
 
+    validator_cleanup(&xdptf.validator);
+    remote_cleanup(&xdptf.remote);
+    pool_cleanup(&xdptf.pool);
     dbus_cleanup(&xdptf);
     pollen_loop_cleanup(xdptf.event_loop);
+    spawner_cleanup();
+    hashmap_free(&xdptf.requests_by_handle);
+    mime_db_cleanup(&xdptf.mime);
+    stats_cleanup(&xdptf.stats);
     config_cleanup(&xdptf.config);
     free(config_path);
 
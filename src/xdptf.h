@@ -2,19 +2,52 @@
 #define XDPTF_H
 
 #include "config.h"
+#include "hashmap.h"
+#include "mime.h"
 #include "pollen.h"
 #include "queue.h"
+#include "pool.h"
+#include "remote.h"
+#include "stats.h"
+#include "validator.h"
 
 struct xdptf {
     struct xdptf_config config;
     struct pollen_loop *event_loop;
+    struct picker_pool pool;
+    struct remote_picker remote;
+    struct request_stats stats;
+    /* not running if it failed to start, paths are checked on main thread then */
+    struct validator validator;
 
     struct sd_bus *sd_bus;
     int sd_bus_fd;
+    /* dbus fd and timer, follow sd_bus_get_events() and sd_bus_get_timeout() */
+    struct pollen_callback *sd_bus_callback;
+    uint32_t sd_bus_events;
+    struct pollen_callback *sd_bus_timer_callback;
+    unsigned long sd_bus_timeout_ms;
+    /* signalled when dbus messages are left over after dbus_process_budget ran out */
+    int sd_bus_wakeup_fd;
+    /* pending flush of sent replies, see dbus_schedule_flush() */
+    struct pollen_callback *sd_bus_flush_callback;
     struct sd_bus_slot *filechooser_vtable_slot;
+    /* fallback vtable for every request object */
+    struct sd_bus_slot *request_vtable_slot;
     struct sd_bus_slot *name_owner_changed_slot;
 
     LIST_HEAD(requests, filechooser_request) requests;
+    /* handle -> request */
+    struct hashmap requests_by_handle;
+    /* requests waiting for running pickers to go below limits, oldest first */
+    TAILQ_HEAD(queued_requests, filechooser_request) queued_requests;
+    int n_queued;
+    int n_running;
+    struct pollen_callback *dequeue_callback;
+    /* picker output held by all requests, see filechooser_request_add_output() */
+    size_t buffered_bytes;
+    /* loaded when a request needs it for filters */
+    struct mime_db mime;
 };
 
 #endif
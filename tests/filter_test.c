@@ -0,0 +1,196 @@
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filter.h"
+#include "log.h"
+
+/*
+ * Checks glob automata against fnmatch() on random patterns and names made of
+ * bytes that mean something to globs, one pattern at a time and many patterns
+ * packed together. Run with "bench" argument to match a million names instead.
+ */
+
+#define CHECK_ROUNDS 200000
+/* enough patterns of MAX_PATTERN_LEN to need more than one 64-bit automaton */
+#define PACKED_PATTERNS 24
+#define MAX_PATTERN_LEN 9
+#define MAX_NAME_LEN 9
+
+#define BENCH_NAMES 1000000
+
+static uint32_t rng_state = 1;
+
+/* xorshift, so failures are reproducible on every libc */
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void random_string(char *dst, const char *alphabet, size_t max_len) {
+    size_t alphabet_len = strlen(alphabet);
+    size_t len = rng() % (max_len + 1);
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = alphabet[rng() % alphabet_len];
+    }
+    dst[len] = '\0';
+}
+
+static void random_pattern(char *dst) {
+    do {
+        random_string(dst, "ab.*?[]!-\\c:=", MAX_PATTERN_LEN);
+        /* fnmatch() and automata disagree on a trailing backslash, it's never a valid glob */
+    } while (dst[0] != '\0' && dst[strlen(dst) - 1] == '\\');
+}
+
+static struct filter_matcher *compile_globs(struct arena *arena, struct mime_db *mime,
+                                            char patterns[][MAX_PATTERN_LEN + 1], int n_patterns) {
+    struct option_filter *filter = arena_alloc(arena, sizeof(*filter));
+    filter->name = "test";
+    filter->rules = arena_alloc(arena, n_patterns * sizeof(*filter->rules));
+    filter->n_rules = n_patterns;
+    for (int i = 0; i < n_patterns; i++) {
+        filter->rules[i].type = OPTION_FILTER_GLOB;
+        filter->rules[i].pattern = patterns[i];
+    }
+    struct option_filter_list filters = { .filters = filter, .n_filters = 1 };
+    return filter_matcher_compile(arena, mime, &filters, NULL);
+}
+
+static int check_globs(struct mime_db *mime, int n_patterns) {
+    char patterns[PACKED_PATTERNS][MAX_PATTERN_LEN + 1];
+    char name[MAX_NAME_LEN + 1];
+
+    for (int round = 0; round < CHECK_ROUNDS / n_patterns; round++) {
+        struct arena *arena = arena_create(4096);
+        for (int i = 0; i < n_patterns; i++) {
+            random_pattern(patterns[i]);
+        }
+        struct filter_matcher *matcher = compile_globs(arena, mime, patterns, n_patterns);
+
+        for (int j = 0; j < 16; j++) {
+            random_string(name, "ab.c-]!", MAX_NAME_LEN);
+            bool expected = false;
+            for (int i = 0; i < n_patterns && !expected; i++) {
+                expected = (fnmatch(patterns[i], name, 0) == 0);
+            }
+            if (filter_matcher_match(matcher, name, strlen(name)) != expected) {
+                printf("filter: %s should %smatch", name, expected ? "" : "not ");
+                for (int i = 0; i < n_patterns; i++) {
+                    printf(" %s", patterns[i]);
+                }
+                printf("\n");
+                arena_destroy(arena);
+                return -1;
+            }
+        }
+        arena_destroy(arena);
+    }
+
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_filter(struct mime_db *mime, char *const names[], const char *label,
+                         uint32_t type, const char *const patterns[], int n_patterns) {
+    struct arena *arena = arena_create(4096);
+    struct option_filter filter = {
+        .name = (char *)label,
+        .rules = arena_alloc(arena, n_patterns * sizeof(*filter.rules)),
+        .n_rules = n_patterns,
+    };
+    for (int i = 0; i < n_patterns; i++) {
+        filter.rules[i].type = type;
+        filter.rules[i].pattern = (char *)patterns[i];
+    }
+    struct option_filter_list filters = { .filters = &filter, .n_filters = 1 };
+    struct filter_matcher *matcher = filter_matcher_compile(arena, mime, &filters, NULL);
+
+    int n_matched = 0;
+    double start = now();
+    for (int i = 0; i < BENCH_NAMES; i++) {
+        n_matched += filter_matcher_match(matcher, names[i], strlen(names[i]));
+    }
+    double elapsed = now() - start;
+    printf("filter: %-8s %7d matched, %6.1f ns/name\n", label, n_matched, elapsed * 1e9 / BENCH_NAMES);
+
+    if (type == OPTION_FILTER_GLOB) {
+        n_matched = 0;
+        start = now();
+        for (int i = 0; i < BENCH_NAMES; i++) {
+            for (int j = 0; j < n_patterns; j++) {
+                if (fnmatch(patterns[j], names[i], 0) == 0) {
+                    n_matched += 1;
+                    break;
+                }
+            }
+        }
+        elapsed = now() - start;
+        printf("filter: %-8s %7d matched, %6.1f ns/name\n", "fnmatch", n_matched,
+               elapsed * 1e9 / BENCH_NAMES);
+    }
+
+    arena_destroy(arena);
+}
+
+static int bench(struct mime_db *mime) {
+    static const char *const extensions[] = {
+        "png", "jpg", "txt", "c", "h", "tar.gz", "JPG", "webp",
+        "md", "pdf", "mp3", "svg", "rs", "go", "jpeg", "gif",
+    };
+    static const char *const image_globs[] = {
+        "*.png", "*.jpg", "*.jpeg", "*.gif", "*.webp", "*.[sS][vV][gG]",
+    };
+    static const char *const image_types[] = { "image/*" };
+    static const char *const text_types[] = { "text/plain" };
+
+    char **names = malloc(BENCH_NAMES * sizeof(*names));
+    if (names == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < BENCH_NAMES; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "some_file_name_%d.%s", i,
+                 extensions[i % (sizeof(extensions) / sizeof(*extensions))]);
+        names[i] = strdup(name);
+    }
+
+    bench_filter(mime, names, "globs", OPTION_FILTER_GLOB, image_globs,
+                 sizeof(image_globs) / sizeof(*image_globs));
+    bench_filter(mime, names, "image/*", OPTION_FILTER_MIME, image_types, 1);
+    bench_filter(mime, names, "text", OPTION_FILTER_MIME, text_types, 1);
+
+    for (int i = 0; i < BENCH_NAMES; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    log_init(stderr, ERROR);
+
+    struct mime_db mime = {0};
+    int ret = 0;
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        ret = bench(&mime);
+    } else if (check_globs(&mime, 1) < 0 || check_globs(&mime, PACKED_PATTERNS) < 0) {
+        printf("filter: FAILED\n");
+        ret = 1;
+    } else {
+        printf("filter: ok\n");
+    }
+
+    mime_db_cleanup(&mime);
+    return ret;
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE /* pipe2() */
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "picker.h"
+#include "log.h"
+
+/*
+ * Times how long the daemon is blocked spawning a trivial picker with
+ * spawn_picker_direct(), against fork() followed by exec in the child like
+ * pickers used to be started, while the heap grows. fork() has to copy page
+ * tables of the whole address space, posix_spawn() doesn't.
+ */
+
+#define ROUNDS 50
+#define MIB (1024 * 1024)
+
+static const size_t heap_steps_mib[] = { 0, 64, 256, 1024 };
+
+static const char *true_exe;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double samples[static ROUNDS]) {
+    qsort(samples, ROUNDS, sizeof(*samples), compare_doubles);
+    return samples[ROUNDS / 2];
+}
+
+/* returns seconds the caller was blocked for, or -1 on failure */
+static double time_spawn(void) {
+    const char *argv[] = { "true", NULL };
+    pid_t pid;
+    int pidfd;
+
+    double start = now();
+    int fd = spawn_picker_direct(true_exe, argv, -1, -1, NULL, &pid, &pidfd);
+    double elapsed = now() - start;
+    if (fd < 0) {
+        return -1;
+    }
+
+    waitpid(pid, NULL, 0);
+    close(pidfd);
+    close(fd);
+    return elapsed;
+}
+
+/* what spawn_picker() did before posix_spawn(): pipe on fd 4, own process group */
+static double time_fork(void) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipe_fds[1], 4);
+        setpgid(0, 0);
+        execl(true_exe, "true", (char *)NULL);
+        _exit(1);
+    }
+    double elapsed = now() - start;
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    if (pid < 0) {
+        return -1;
+    }
+    waitpid(pid, NULL, 0);
+    return elapsed;
+}
+
+static int bench(const char *label, double (*spawn)(void), size_t heap_mib) {
+    double samples[ROUNDS];
+    for (int i = 0; i < ROUNDS; i++) {
+        if ((samples[i] = spawn()) < 0) {
+            printf("spawn: %s failed\n", label);
+            return -1;
+        }
+    }
+    printf("spawn: %5zu MiB heap, %-11s %8.1f us\n", heap_mib, label, median(samples) * 1e6);
+    return 0;
+}
+
+int main(void) {
+    log_init(stderr, ERROR);
+
+    true_exe = access("/usr/bin/true", X_OK) == 0 ? "/usr/bin/true" : "/bin/true";
+
+    /* heap is grown in place between steps and kept until the end */
+    char *chunks[sizeof(heap_steps_mib) / sizeof(*heap_steps_mib)] = {0};
+    size_t heap_mib = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < sizeof(heap_steps_mib) / sizeof(*heap_steps_mib); i++) {
+        size_t grow_mib = heap_steps_mib[i] - heap_mib;
+        if (grow_mib > 0) {
+            if ((chunks[i] = malloc(grow_mib * MIB)) == NULL) {
+                printf("spawn: failed to grow heap to %zu MiB\n", heap_steps_mib[i]);
+                ret = 1;
+                break;
+            }
+            /* touched, so pages are really mapped */
+            memset(chunks[i], 1, grow_mib * MIB);
+            heap_mib = heap_steps_mib[i];
+        }
+
+        if (bench("posix_spawn", time_spawn, heap_mib) < 0 ||
+                bench("fork", time_fork, heap_mib) < 0) {
+            ret = 1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(chunks) / sizeof(*chunks); i++) {
+        free(chunks[i]);
+    }
+    return ret;
+}
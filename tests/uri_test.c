@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* included, so every encoder that is compiled in can be checked, not only the one picked at runtime */
+#include "uri.c"
+
+/*
+ * Checks every vectorized encoder against the scalar one: every byte value at
+ * every position of strings up to MAX_LEN bytes, so the vector loop and every
+ * tail length both see it. Run with "bench" argument to measure throughput instead.
+ */
+
+/* two avx2 vectors and a bit, every tail length is covered for all encoders */
+#define MAX_LEN 70
+
+#define BENCH_SIZE (1024 * 1024)
+#define BENCH_ROUNDS 200
+
+static const struct uri_encoder reference_encoder = {
+    .name = "scalar",
+    .safe_span = scalar_safe_span,
+    .count_unsafe = scalar_count_unsafe,
+};
+
+/* returns number of encoders put in encoders, reference is not one of them */
+static int get_encoders(const struct uri_encoder *encoders[static 4]) {
+    int n = 0;
+#if defined(HAVE_AVX2_ENCODER)
+    if (__builtin_cpu_supports("avx2")) {
+        encoders[n++] = &avx2_encoder;
+    } else {
+        printf("uri: cpu doesn't support avx2, skipping it\n");
+    }
+#endif
+#if defined(__SSE2__)
+    encoders[n++] = &sse2_encoder;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    encoders[n++] = &neon_encoder;
+#else
+    encoders[n++] = &scalar_encoder;
+#endif
+    return n;
+}
+
+/* str has exactly len bytes, so reads past the end are caught by sanitizers */
+static int check_string(const struct uri_encoder *encoder, const char *str, size_t len) {
+    static char expected[MAX_LEN * 3 + 1];
+    static char got[MAX_LEN * 3 + 1];
+
+    size_t expected_span = reference_encoder.safe_span(str, len);
+    size_t got_span = encoder->safe_span(str, len);
+    if (got_span != expected_span) {
+        printf("uri: %s safe_span() is %zu instead of %zu\n", encoder->name, got_span, expected_span);
+        return -1;
+    }
+
+    size_t expected_len = encoded_len(&reference_encoder, str, len);
+    size_t got_len = encoded_len(encoder, str, len);
+    if (got_len != expected_len) {
+        printf("uri: %s encoded_len() is %zu instead of %zu\n", encoder->name, got_len, expected_len);
+        return -1;
+    }
+
+    encode_into(&reference_encoder, expected, str, len);
+    encode_into(encoder, got, str, len);
+    if (strcmp(got, expected) != 0) {
+        printf("uri: %s encoded to %s instead of %s\n", encoder->name, got, expected);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int check_encoder(const struct uri_encoder *encoder) {
+    for (size_t len = 1; len <= MAX_LEN; len++) {
+        char *str = malloc(len);
+        if (str == NULL) {
+            return -1;
+        }
+        for (int c = 0; c < 256; c++) {
+            /* c alone in safe bytes */
+            for (size_t pos = 0; pos < len; pos++) {
+                memset(str, 'a', len);
+                str[pos] = c;
+                if (check_string(encoder, str, len) < 0) {
+                    printf("uri: byte 0x%02X at %zu of %zu\n", c, pos, len);
+                    free(str);
+                    return -1;
+                }
+            }
+            /* nothing but c */
+            memset(str, c, len);
+            if (check_string(encoder, str, len) < 0) {
+                printf("uri: %zu bytes of 0x%02X\n", len, c);
+                free(str);
+                return -1;
+            }
+        }
+        free(str);
+    }
+
+    return check_string(encoder, "", 0);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_encoder(const struct uri_encoder *encoder, const char *str, char *dst) {
+    double start = now();
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        encode_into(encoder, dst, str, BENCH_SIZE);
+    }
+    double elapsed = now() - start;
+
+    printf("uri: %-6s %8.1f MiB/s\n", encoder->name,
+           (double)BENCH_SIZE * BENCH_ROUNDS / (1024 * 1024) / elapsed);
+}
+
+/* paths are mostly safe bytes, with a space or non-ascii byte here and there */
+static int bench(const struct uri_encoder *encoders[], int n_encoders) {
+    static const char sample[] = "/home/user/Pictures/2024/IMG_0042 (copy).jpg/doc/\xc3\xa9t\xc3\xa9.pdf";
+
+    char *str = malloc(BENCH_SIZE);
+    char *dst = malloc(BENCH_SIZE * 3 + 1);
+    if (str == NULL || dst == NULL) {
+        free(str);
+        free(dst);
+        return 1;
+    }
+    for (size_t i = 0; i < BENCH_SIZE; i++) {
+        str[i] = sample[i % (sizeof(sample) - 1)];
+    }
+
+    bench_encoder(&reference_encoder, str, dst);
+    for (int i = 0; i < n_encoders; i++) {
+        bench_encoder(encoders[i], str, dst);
+    }
+
+    free(str);
+    free(dst);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    log_init(stderr, ERROR);
+
+    const struct uri_encoder *encoders[4];
+    int n_encoders = get_encoders(encoders);
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return bench(encoders, n_encoders);
+    }
+
+    int ret = 0;
+    for (int i = 0; i < n_encoders; i++) {
+        if (check_encoder(encoders[i]) < 0) {
+            printf("uri: %s FAILED\n", encoders[i]->name);
+            ret = 1;
+        } else {
+            printf("uri: %s ok\n", encoders[i]->name);
+        }
+    }
+
+    return ret;
+}